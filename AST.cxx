@@ -1,9 +1,19 @@
 #include "AST.hxx"
 #include "exceptions.hxx"
+#include "emit.hxx"
+#include "target.hxx"
+#include "profile.hxx"
+#include "specialize.hxx"
 #include <iostream>
+#include <sstream>
 #include <cstdlib>
+#include <cstring>
+#include <cmath>
 
 #include "llvm/BasicBlock.h"
+#include "llvm/CallingConv.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Intrinsics.h"
 
 using namespace ncc;
 
@@ -29,16 +39,104 @@ static std::string type_name(ValueType type){
   }
 }
 
+FPModel ncc::get_fp_model(const std::string& name){
+  if (name == "strict"){
+    return FP_STRICT;
+  }
+  if (name == "contract"){
+    return FP_CONTRACT;
+  }
+  if (name == "fast"){
+    return FP_FAST;
+  }
+  throw new UnknownFPModel(name);
+}
+
+static const char* known_attributes[] = {
+  "export",
+  "fp_model",
+  "target_clones"
+};
+
+/* a prototype has no code for fp_model or target_clones to apply to */
+static void check_attributes(const AttributeVector& attributes, 
+                             bool has_body){
+  for (AttributeVector::const_iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    unsigned int j;
+    for (j = 0; j < sizeof(known_attributes) / sizeof(char*); j++){
+      if ((*i)->get_name() == known_attributes[j]){
+        break;
+      }
+    }
+    if (j == sizeof(known_attributes) / sizeof(char*)){
+      throw new UnknownAttribute((*i)->get_name());
+    }
+    if (!has_body && ((*i)->get_name() == "fp_model"
+                      || (*i)->get_name() == "target_clones")){
+      throw new MisplacedAttribute((*i)->get_name());
+    }
+  }
+}
+
+/*
+ * The ISAs of [[target_clones("sse3", ..., "default")]] but "default",
+ * which must be among them. The JIT compiles for the host anyway, only
+ * the assembly emitted ahead of time gets the clones.
+ */
+static std::vector<std::string> clone_targets(Attribute* clones){
+  std::vector<std::string> isas;
+  bool has_default = false;
+
+  for (std::vector<std::string>::const_iterator i = 
+         clones->get_arguments().begin();
+       i != clones->get_arguments().end(); i++){
+    if (*i == "default"){
+      has_default = true;
+    } else if (get_clone_feature_bit(*i) >= 0){
+      isas.push_back(*i);
+    } else {
+      throw new InvalidAttributeArguments(clones->get_name());
+    }
+  }
+  if (!has_default || isas.empty()){
+    throw new InvalidAttributeArguments(clones->get_name());
+  }
+  return isas;
+}
+
+/*
+ * Division by a constant can be replaced by multiplication with its
+ * reciprocal. That is always exact for (normal) powers of two, any
+ * other divisor changes rounding and is only allowed in fast mode.
+ */
+static bool reciprocal_allowed(double divisor, FPModel model){
+  int exp;
+  double reciprocal;
+
+  if (divisor == 0.0){
+    return false;
+  }
+  reciprocal = 1.0 / divisor;
+  if (reciprocal - reciprocal != 0.0){
+    return false;
+  }
+  if (model == FP_FAST){
+    return true;
+  }
+  return std::fabs(std::frexp(divisor, &exp)) == 0.5 
+    && exp > -1021 && exp < 1023;
+}
+
+/* pointers are i8* like a C void*, LLVM uniques that type for us */
 static const llvm::Type* llvm_type(ValueType type){
-  static llvm::Type* ptr = 
-    llvm::PointerType::getUnqual(llvm::OpaqueType::get());
   switch (type){
   case TYPE_INTEGER:
     return llvm::Type::Int32Ty;
   case TYPE_DOUBLE:
     return llvm::Type::DoubleTy;
   case TYPE_POINTER:
-    return ptr;
+    return llvm::PointerType::getUnqual(llvm::Type::Int8Ty);
   default:
     abort();
   }
@@ -72,6 +170,28 @@ static llvm::Value* coerce_value(llvm::LLVMBuilder& builder,
   throw new IncompatibleTypes();  
 }
 
+/* record global variable accesses of the function being generated */
+static void note_global_access(SymbolTable* st, Variable& var, bool write){
+  Function* f = st->get_lex_function();
+  if (!f || !llvm::isa<llvm::GlobalVariable>(var.get_address())){
+    return;
+  }
+  if (write){
+    f->note_global_write();
+  } else {
+    f->note_global_read();
+  }
+}
+
+static void profile_branch(llvm::LLVMBuilder& builder, SymbolTable* st,
+                           llvm::Value* cond, llvm::BasicBlock* on_true, 
+                           llvm::BasicBlock* on_false){
+  Profile* profile = st->get_options().profile;
+  if (profile){
+    profile->branch(builder, cond, on_true, on_false);
+  }
+}
+
 #define NAME(x) #x
 static const char* binop_names[] = {
   NAME(BINOP_ADD),
@@ -92,6 +212,53 @@ static const char* binop_names[] = {
 
 
 ASTNode::~ASTNode(){}
+void CanonicalForm::add(const char* s){
+  text += s;
+  text += ' ';
+}
+void CanonicalForm::add(int n){
+  std::ostringstream s;
+  s << n << ' ';
+  text += s.str();
+}
+/* by its bits, printing would round */
+void CanonicalForm::add(double d){
+  unsigned long long bits;
+  std::ostringstream s;
+  memcpy(&bits, &d, sizeof(bits));
+  s << std::hex << bits << ' ';
+  text += s.str();
+}
+/* prefixed with its length, so that it cannot run into what follows */
+void CanonicalForm::add(const std::string& s){
+  add((int)s.size());
+  text += s;
+  text += ' ';
+}
+void CanonicalForm::declare(const std::string& name){
+  locals[name] = next_local;
+  add("local");
+  add(next_local++);
+}
+void CanonicalForm::reference(const std::string& name){
+  std::map<std::string, int>::iterator i = locals.find(name);
+  if (i != locals.end()){
+    add("local");
+    add(i->second);
+  } else {
+    add("global");
+    add(name);
+  }
+}
+void CanonicalForm::call(const std::string& name){
+  if (name == self){
+    add("self");
+  } else {
+    add("function");
+    add(name);
+  }
+}
+
 Statement::~Statement(){}
 Expression::~Expression(){}
 
@@ -105,6 +272,12 @@ void BinaryOperation::print(std::ostream& stream, int indent){
   left->print(stream, indent+2);
   right->print(stream, indent+2);
 }
+void BinaryOperation::canonicalize(CanonicalForm& form){
+  form.add("binop");
+  form.add((int)op);
+  left->canonicalize(form);
+  right->canonicalize(form);
+}
 llvm::Value* BinaryOperation::generate(llvm::LLVMBuilder& builder,
                                        SymbolTable* st){
   llvm::Value* lv;
@@ -138,7 +311,15 @@ llvm::Value* BinaryOperation::generate(llvm::LLVMBuilder& builder,
     return rt;
   case BINOP_DIV:
     if (type == TYPE_DOUBLE){
-      rt = builder.CreateFDiv(lv, rv, "bor");
+      DoubleLiteral* divisor = dynamic_cast<DoubleLiteral*>(right);
+      if (divisor && reciprocal_allowed(divisor->get_value(), 
+                                        st->get_lex_fp_model())){
+        rt = llvm::ConstantFP::get(llvm::Type::DoubleTy,
+                                   llvm::APFloat(1.0 / divisor->get_value()));
+        rt = builder.CreateMul(lv, rt, "bor");
+      } else {
+        rt = builder.CreateFDiv(lv, rv, "bor");
+      }
     } else {
       rt = builder.CreateSDiv(lv, rv, "bor");
     }
@@ -248,6 +429,12 @@ void ShortCircuitOperation::print(std::ostream& stream, int indent){
   left->print(stream, indent+2);
   right->print(stream, indent+2);
 }
+void ShortCircuitOperation::canonicalize(CanonicalForm& form){
+  form.add("shortcircuit");
+  form.add((int)op);
+  left->canonicalize(form);
+  right->canonicalize(form);
+}
 llvm::Value* ShortCircuitOperation::generate(llvm::LLVMBuilder& builder,
                                              SymbolTable* st){
   llvm::Function* f = builder.GetInsertBlock()->getParent();
@@ -272,6 +459,7 @@ llvm::Value* ShortCircuitOperation::generate(llvm::LLVMBuilder& builder,
     break;
   }
   llvm::BasicBlock* l_orig = builder.GetInsertBlock();
+  profile_branch(builder, st, c, NULL, l_right);
   builder.CreateCondBr(c, l_cont, l_right);
   
   builder.SetInsertPoint(l_right);
@@ -302,6 +490,12 @@ void ConditionalExpression::print(std::ostream& stream, int indent){
   cons->print(stream, indent+2);
   alt->print(stream, indent+2);
 }
+void ConditionalExpression::canonicalize(CanonicalForm& form){
+  form.add("?:");
+  cond->canonicalize(form);
+  cons->canonicalize(form);
+  alt->canonicalize(form);
+}
 llvm::Value* ConditionalExpression::generate(llvm::LLVMBuilder& builder,
                                              SymbolTable* st){
   llvm::Function* f = builder.GetInsertBlock()->getParent();
@@ -315,6 +509,7 @@ llvm::Value* ConditionalExpression::generate(llvm::LLVMBuilder& builder,
   c = builder.CreateICmpNE(c, 
                            llvm::ConstantInt::get(llvm::APInt(32, 0, true)),
                            "condition");
+  profile_branch(builder, st, c, then, els);
   builder.CreateCondBr(c, then, els);
   
   builder.SetInsertPoint(then);
@@ -347,6 +542,12 @@ void Assignment::print(std::ostream& stream, int indent){
   stream << "Assignment into " << variable << std::endl;
   value->print(stream, indent+2);
 }
+void Assignment::canonicalize(CanonicalForm& form){
+  form.add("assign");
+  form.add((int)op);
+  form.reference(variable);
+  value->canonicalize(form);
+}
 llvm::Value* Assignment::generate(llvm::LLVMBuilder& builder, 
                                   SymbolTable* st){
   llvm::Value* val = value->generate(builder, st);
@@ -364,6 +565,7 @@ llvm::Value* Assignment::generate(llvm::LLVMBuilder& builder,
     }
   }
 
+  note_global_access(st, var, true);
   builder.CreateStore(val, var.get_address());
   return val;
 }
@@ -389,6 +591,11 @@ void UnaryOperation::print(std::ostream& stream, int indent){
   }
   expr->print(stream, indent+2);
 }
+void UnaryOperation::canonicalize(CanonicalForm& form){
+  form.add("unop");
+  form.add((int)op);
+  expr->canonicalize(form);
+}
 llvm::Value* UnaryOperation::generate(llvm::LLVMBuilder& builder, 
                                       SymbolTable* st){
   llvm::Value* v;
@@ -430,11 +637,192 @@ void FunCall::print(std::ostream& stream, int indent){
     (*i)->print(stream, indent+2);
   }
 }
+void FunCall::canonicalize(CanonicalForm& form){
+  form.add("call");
+  form.call(function);
+  form.add((int)arguments.size());
+  for (ExpressionVector::iterator i = arguments.begin();
+       i != arguments.end(); i++){
+    (*i)->canonicalize(form);
+  }
+}
+/*
+ * Builtin functions are lowered directly to LLVM intrinsics or inline
+ * code, so the optimizer can fold and schedule them. Functions without
+ * a matching intrinsic are called in libm, declared as not accessing
+ * memory. A builtin is shadowed by a user definition of the same name,
+ * but not by a mere declaration.
+ */
+enum BuiltinKind {
+  BUILTIN_INTRINSIC,
+  BUILTIN_LIBM,
+  BUILTIN_FABS,
+  BUILTIN_ABS
+};
+
+struct Builtin {
+  const char* name;
+  BuiltinKind kind;
+  llvm::Intrinsic::ID intrinsic;
+  ValueType type;
+  int arg_count;
+};
+
+static Builtin builtins[] = {
+  {"sqrt", BUILTIN_INTRINSIC, llvm::Intrinsic::sqrt, TYPE_DOUBLE, 1},
+  {"sin", BUILTIN_INTRINSIC, llvm::Intrinsic::sin, TYPE_DOUBLE, 1},
+  {"cos", BUILTIN_INTRINSIC, llvm::Intrinsic::cos, TYPE_DOUBLE, 1},
+  {"pow", BUILTIN_INTRINSIC, llvm::Intrinsic::pow, TYPE_DOUBLE, 2},
+  {"fabs", BUILTIN_FABS, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 1},
+  {"floor", BUILTIN_LIBM, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 1},
+  {"ceil", BUILTIN_LIBM, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 1},
+  {"exp", BUILTIN_LIBM, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 1},
+  {"log", BUILTIN_LIBM, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 1},
+  {"fma", BUILTIN_LIBM, llvm::Intrinsic::not_intrinsic, TYPE_DOUBLE, 3},
+  {"popcount", BUILTIN_INTRINSIC, llvm::Intrinsic::ctpop, TYPE_INTEGER, 1},
+  {"ctlz", BUILTIN_INTRINSIC, llvm::Intrinsic::ctlz, TYPE_INTEGER, 1},
+  {"cttz", BUILTIN_INTRINSIC, llvm::Intrinsic::cttz, TYPE_INTEGER, 1},
+  {"abs", BUILTIN_ABS, llvm::Intrinsic::not_intrinsic, TYPE_INTEGER, 1},
+};
+
+static bool is_builtin_name(const std::string& name){
+  for (unsigned int i = 0; i < sizeof(builtins) / sizeof(Builtin); i++){
+    if (name == builtins[i].name){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* any function of the program, even a prototype, hides the builtin */
+static Builtin* find_builtin(const std::string& name, SymbolTable* st){
+  if (st->find_function(name)){
+    return NULL;
+  }
+  for (unsigned int i = 0; i < sizeof(builtins) / sizeof(Builtin); i++){
+    if (name == builtins[i].name){
+      return &builtins[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Calls generated so far went to the builtin, so a body of that name
+ * from now on would give them a different meaning, and would complete
+ * the readnone declaration made for a library builtin. Code loaded from
+ * the cache only leaves that declaration behind.
+ */
+static void check_builtin_unused(const std::string& name, 
+                                 llvm::Module* module, SymbolTable* st){
+  llvm::Function* f = module->getFunction(name);
+  if (st->get_function_table()->uses_builtin(name)
+      || (f && !st->find_function(name) && is_builtin_name(name))){
+    throw new SymbolRedefined(name);
+  }
+}
+
+static llvm::Function* libm_function(llvm::Module* module, Builtin* b){
+  std::vector<const llvm::Type*> arg_types(b->arg_count, llvm_type(b->type));
+  llvm::FunctionType* t = llvm::FunctionType::get(llvm_type(b->type), 
+                                                  arg_types, 
+                                                  false);
+  llvm::Function* f = module->getFunction(b->name);
+  if (f){
+    /* a prototype of the program may have claimed the name */
+    if (f->getFunctionType() != t){
+      throw new IncompatibleTypes();
+    }
+    return f;
+  }
+  f = new llvm::Function(t, 
+                         llvm::GlobalValue::ExternalLinkage,
+                         b->name,
+                         module);
+  f->setDoesNotAccessMemory();
+  f->setDoesNotThrow();
+  return f;
+}
+
+static llvm::Value* generate_builtin(llvm::LLVMBuilder& builder,
+                                     Builtin* b,
+                                     std::vector<llvm::Value*>& a){
+  llvm::Module* module = builder.GetInsertBlock()->getParent()->getParent();
+  const llvm::Type* t = llvm_type(b->type);
+  llvm::Value* v;
+  llvm::Value* c;
+
+  switch (b->kind){
+  case BUILTIN_INTRINSIC:
+    return builder.CreateCall(llvm::Intrinsic::getDeclaration(module, 
+                                                              b->intrinsic,
+                                                              &t, 1),
+                              a.begin(), a.end(), "builtin");
+  case BUILTIN_LIBM:
+    return builder.CreateCall(libm_function(module, b), 
+                              a.begin(), a.end(), "builtin");
+  case BUILTIN_FABS:
+    /* clear the sign bit, so that fabs(-0.0) is +0.0 */
+    v = builder.CreateBitCast(a[0], llvm::Type::Int64Ty, "fabs");
+    v = builder.CreateAnd(v, 
+                          llvm::ConstantInt::get(llvm::Type::Int64Ty,
+                                                 0x7fffffffffffffffULL),
+                          "fabs");
+    return builder.CreateBitCast(v, t, "builtin");
+  case BUILTIN_ABS:
+    c = builder.CreateICmpSLT(a[0], 
+                              llvm::ConstantInt::get(llvm::APInt(32, 0, true)),
+                              "abs");
+    return builder.CreateSelect(c, builder.CreateNeg(a[0], "abs"), a[0], 
+                                "builtin");
+  }
+  return NULL;
+}
+
+/*
+ * The cell of a function holds the address of its current code. It is
+ * an external variable, so that optimizers cannot assume its value.
+ */
+static llvm::GlobalVariable* function_cell(Function& f){
+  llvm::Function* address = f.get_address();
+  if (!f.get_cell()){
+    f.set_cell(new llvm::GlobalVariable(address->getType(),
+                                        false,
+                                        llvm::GlobalValue::ExternalLinkage,
+                                        address,
+                                        address->getName() + ".cell",
+                                        address->getParent()));
+  }
+  return f.get_cell();
+}
+
 llvm::Value* FunCall::generate(llvm::LLVMBuilder& builder, 
                                SymbolTable* st){
-  Function& f = st->get_function(function);
   std::vector<llvm::Value *> a;
   int n = 0;
+  Builtin* b = find_builtin(function, st);
+
+  if (b){
+    for (ExpressionVector::iterator i = arguments.begin();
+         i != arguments.end(); i++, n++){
+      if (n >= b->arg_count){
+        throw new TooManyArguments(function);
+      }
+      llvm::Value* v = (*i)->generate(builder, st);
+      v = coerce_value(builder, v, (*i)->get_type(st), b->type);
+      a.push_back(v);
+    }
+    if (n < b->arg_count){
+      throw new TooFewArguments(function);
+    }
+    st->get_function_table()->note_builtin(function);
+    return generate_builtin(builder, b, a);
+  }
+
+  Function& f = st->get_function(function);
+  if (st->get_lex_function()){
+    st->get_lex_function()->note_call(function);
+  }
   for (ExpressionVector::iterator i = arguments.begin();
        i != arguments.end(); i++, n++){
     if (n >= f.get_arg_count()){
@@ -445,9 +833,21 @@ llvm::Value* FunCall::generate(llvm::LLVMBuilder& builder,
     a.push_back(v);
   }
   
-  return builder.CreateCall(f.get_address(), a.begin(), a.end(), "funcall");
+  llvm::Value* target = f.get_address();
+  if (st->get_options().uses_cells()){
+    target = builder.CreateLoad(function_cell(f), "target");
+  }
+  llvm::CallInst* call = builder.CreateCall(target, 
+                                            a.begin(), a.end(), 
+                                            "funcall");
+  call->setCallingConv(f.get_address()->getCallingConv());
+  return call;
 }
 ValueType FunCall::get_type(SymbolTable* st){
+  Builtin* b = find_builtin(function, st);
+  if (b){
+    return b->type;
+  }
   return st->get_function(function).get_ret_type();
 }
 
@@ -457,10 +857,15 @@ void VariableReference::print(std::ostream& stream, int indent){
   print_indent(stream, indent);
   stream << "VariableReference " << name << std::endl;
 }
+void VariableReference::canonicalize(CanonicalForm& form){
+  form.add("var");
+  form.reference(name);
+}
 llvm::Value* VariableReference::generate(llvm::LLVMBuilder& builder, 
                                          SymbolTable* st){
   Variable& v = st->get_symbol(name);
 
+  note_global_access(st, v, false);
   return builder.CreateLoad(v.get_address(), name.c_str());
 }
 ValueType VariableReference::get_type(SymbolTable* st){
@@ -473,6 +878,10 @@ void IntegerLiteral::print(std::ostream& stream, int indent){
   print_indent(stream, indent);
   stream << "IntegerLiteral " << value << std::endl;
 }
+void IntegerLiteral::canonicalize(CanonicalForm& form){
+  form.add("int");
+  form.add(value);
+}
 llvm::Value* IntegerLiteral::generate(llvm::LLVMBuilder& builder, 
                                          SymbolTable* st){
   return llvm::ConstantInt::get(llvm::APInt(32, value, true));
@@ -485,6 +894,10 @@ void DoubleLiteral::print(std::ostream& stream, int indent){
   print_indent(stream, indent);
   stream << "DoubleLiteral " << value << std::endl;
 }
+void DoubleLiteral::canonicalize(CanonicalForm& form){
+  form.add("double");
+  form.add(value);
+}
 llvm::Value* DoubleLiteral::generate(llvm::LLVMBuilder& builder, 
                                          SymbolTable* st){
   return llvm::ConstantFP::get(llvm::Type::DoubleTy, 
@@ -499,6 +912,10 @@ void StringLiteral::print(std::ostream& stream, int indent){
   print_indent(stream, indent);
   stream << "StringLiteral " << value << std::endl;
 }
+void StringLiteral::canonicalize(CanonicalForm& form){
+  form.add("string");
+  form.add(value);
+}
 llvm::Value* StringLiteral::generate(llvm::LLVMBuilder& builder, 
                                      SymbolTable* st){
   throw new FeatureNotImplemented("string literals");
@@ -521,6 +938,14 @@ void Block::print(std::ostream& stream, int indent){
     (*i)->print(stream, indent+2);
   }
 }
+void Block::canonicalize(CanonicalForm& form){
+  form.add("{");
+  for (StatementVector::iterator i = statements.begin();
+       i != statements.end(); i++){
+    (*i)->canonicalize(form);
+  }
+  form.add("}");
+}
 llvm::Value* Block::generate(llvm::LLVMBuilder& builder, 
                              SymbolTable* st){
   for (StatementVector::iterator i = statements.begin();
@@ -546,6 +971,16 @@ void ConditionalStatement::print(std::ostream& stream, int indent){
     alt->print(stream, indent+2);
   }
 }
+void ConditionalStatement::canonicalize(CanonicalForm& form){
+  form.add("if");
+  cond->canonicalize(form);
+  cons->canonicalize(form);
+  if (alt){
+    form.add("else");
+    alt->canonicalize(form);
+  }
+  form.add("endif");
+}
 llvm::Value* ConditionalStatement::generate(llvm::LLVMBuilder& builder, 
                                             SymbolTable* st){
   llvm::Function* f = builder.GetInsertBlock()->getParent();
@@ -557,6 +992,7 @@ llvm::Value* ConditionalStatement::generate(llvm::LLVMBuilder& builder,
   c = builder.CreateICmpNE(c, 
                            llvm::ConstantInt::get(llvm::APInt(32, 0, true)),
                            "condition");
+  profile_branch(builder, st, c, then, els);
   builder.CreateCondBr(c, then, els);
   
   builder.SetInsertPoint(then);
@@ -588,6 +1024,10 @@ void ReturnStatement::print(std::ostream& stream, int indent){
   stream << "ReturnStatement" << std::endl;
   expr->print(stream, indent+2);
 }
+void ReturnStatement::canonicalize(CanonicalForm& form){
+  form.add("return");
+  expr->canonicalize(form);
+}
 
 WhileStatement::~WhileStatement(){
   delete cond;
@@ -599,6 +1039,11 @@ void WhileStatement::print(std::ostream& stream, int indent){
   cond->print(stream, indent+2);
   body->print(stream, indent+2);
 }
+void WhileStatement::canonicalize(CanonicalForm& form){
+  form.add("while");
+  cond->canonicalize(form);
+  body->canonicalize(form);
+}
 llvm::Value* WhileStatement::generate(llvm::LLVMBuilder& builder, 
                                        SymbolTable* st){
   llvm::Function* f = builder.GetInsertBlock()->getParent();
@@ -613,6 +1058,7 @@ llvm::Value* WhileStatement::generate(llvm::LLVMBuilder& builder,
   c = builder.CreateICmpNE(c, 
                            llvm::ConstantInt::get(llvm::APInt(32, 0, true)),
                            "condition");
+  profile_branch(builder, st, c, l_body, NULL);
   builder.CreateCondBr(c, l_body, l_cont);
   
   builder.SetInsertPoint(l_body);
@@ -639,6 +1085,17 @@ void LocalVariable::print(std::ostream& stream, int indent){
     value->print(stream, indent+2);
   }
 }
+void LocalVariable::canonicalize(CanonicalForm& form){
+  form.add("local");
+  form.add((int)type);
+  /* the initializer is evaluated before the name is bound */
+  if (value){
+    value->canonicalize(form);
+  } else {
+    form.add("uninitialized");
+  }
+  form.declare(name);
+}
 llvm::Value* LocalVariable::generate(llvm::LLVMBuilder& builder, 
                                      SymbolTable* st){
   llvm::Value* var = builder.CreateAlloca(llvm_type(type),0, name.c_str());
@@ -673,8 +1130,10 @@ void GlobalVariable::generate(llvm::Module* module,
   
   gv = new llvm::GlobalVariable(llvm_type(type),
                                 false,
+                                st->get_options().whole_program ?
+                                llvm::GlobalValue::InternalLinkage :
                                 llvm::GlobalValue::ExternalLinkage,
-                                llvm::UndefValue::get(llvm_type(type)),
+                                llvm::Constant::getNullValue(llvm_type(type)),
                                 name,
                                 module);
 
@@ -686,14 +1145,60 @@ void Argument::print(std::ostream& stream, int indent){
   stream << "Argument " << type_name(type) << " " << name << std::endl; 
 }
 
+void Attribute::print(std::ostream& stream, int indent){
+  print_indent(stream, indent);
+  stream << "Attribute " << name;
+  for (std::vector<std::string>::iterator i = arguments.begin();
+       i != arguments.end(); i++){
+    stream << " " << *i;
+  }
+  stream << std::endl;
+}
+
+static void set_calling_conv(llvm::Function* f, unsigned cc){
+  f->setCallingConv(cc);
+  for (llvm::Value::use_iterator i = f->use_begin(); 
+       i != f->use_end(); i++){
+    llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(*i);
+    if (call){
+      call->setCallingConv(cc);
+    }
+  }
+}
+
 FunctionDeclaration::~FunctionDeclaration(){
   for (ArgumentVector::iterator i = arguments.begin();
        i != arguments.end(); i++){
     delete *i;
   }
+  for (AttributeVector::iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    delete *i;
+  }
+}
+Attribute* FunctionDeclaration::get_attribute(const std::string& name){
+  for (AttributeVector::iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    if ((*i)->get_name() == name){
+      return *i;
+    }
+  }
+  return NULL;
+}
+std::vector<ValueType> FunctionDeclaration::get_arg_types(){
+  std::vector<ValueType> types;
+  for (ArgumentVector::iterator i = arguments.begin();
+       i != arguments.end(); i++){
+    types.push_back((*i)->get_type());
+  }
+  return types;
 }
 void FunctionDeclaration::print(std::ostream& stream, int indent){
   stream << "FunctionDeclaration " << name << std::endl; 
+  for (AttributeVector::iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    (*i)->print(stream, indent+2);
+  }
   for (ArgumentVector::iterator i = arguments.begin();
        i != arguments.end(); i++){
     (*i)->print(stream, indent+2);
@@ -703,6 +1208,9 @@ void FunctionDeclaration::generate(llvm::Module* module,
                                    SymbolTable* st){
   std::vector<const llvm::Type*> arg_types;
   std::vector<ValueType> arg_vtypes;
+
+  check_attributes(attributes, false);
+  check_builtin_unused(name, module, st);
   for (ArgumentVector::iterator i = arguments.begin();
        i != arguments.end(); i++){
     arg_types.push_back(llvm_type((*i)->get_type()));
@@ -712,11 +1220,17 @@ void FunctionDeclaration::generate(llvm::Module* module,
   llvm::FunctionType* t = llvm::FunctionType::get(llvm_type(type), 
                                                   arg_types, 
                                                   false);
-  llvm::Function* f = 
-    new llvm::Function(t, 
-                       llvm::GlobalValue::ExternalLinkage,
-                       name,
-                       module);
+  llvm::Function* f = module->getFunction(name);
+  if (f){
+    if (f->getFunctionType() != t){
+      throw new IncompatibleTypes();
+    }
+    return;
+  }
+  f = new llvm::Function(t, 
+                         llvm::GlobalValue::ExternalLinkage,
+                         name,
+                         module);
 
   llvm::Function::arg_iterator j = f->arg_begin();
   for (ArgumentVector::iterator i = arguments.begin();
@@ -733,17 +1247,201 @@ FunctionDefinition::~FunctionDefinition(){
 }
 void FunctionDefinition::print(std::ostream& stream, int indent){
   stream << "FunctionDefinition " << name << std::endl; 
+  for (AttributeVector::iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    (*i)->print(stream, indent+2);
+  }
   stream << "  Arguments" << std::endl; 
   for (ArgumentVector::iterator i = arguments.begin();
        i != arguments.end(); i++){
     (*i)->print(stream, indent+4);
   }
-  contents->print(stream, indent+2);
+  if (contents){
+    contents->print(stream, indent+2);
+  } else {
+    stream << std::string(indent+2, ' ') << "(generated while parsing)" 
+           << std::endl;
+  }
 }
 void FunctionDefinition::generate(llvm::Module* module,
                                   SymbolTable* st){
+  if (!contents){
+    return;
+  }
+
+  std::string form;
+  std::string original;
+  if (can_share(st)){
+    form = canonical_form(st);
+    const std::string* owner = st->get_function_table()->find_body(form);
+    if (owner){
+      original = *owner;
+    }
+  }
+
+  /* a body that fails leaves the function as it was before */
+  Function* old = st->find_function(name);
+  Function previous = old ? *old : Function();
+  llvm::Function* existing = module->getFunction(name);
+  unsigned int previous_cc = existing ? existing->getCallingConv() 
+    : llvm::CallingConv::C;
+  llvm::Function* f = define(module, st);
+
+  try {
+    if (!original.empty()){
+      share_body(f, st, original);
+    } else {
+      generate_body(f, st);
+    }
+  } catch (std::exception* e){
+    undefine(f, st, old ? &previous : NULL, previous_cc);
+    throw;
+  }
+  if (original.empty() && !form.empty()){
+    st->get_function_table()->put_body(form, name);
+  }
+}
+/*
+ * Bodies are only shared when nothing but the body decides the code:
+ * instrumentation, replacement and eviction work on one function at a
+ * time.
+ */
+bool FunctionDefinition::can_share(SymbolTable* st){
+  const CodegenOptions& options = st->get_options();
+  return options.dedup && !options.profile && !options.specializer
+    && !options.uses_cells() && !has_attribute("target_clones");
+}
+/* equal for definitions that only differ in the names they introduce */
+std::string FunctionDefinition::canonical_form(SymbolTable* st){
+  CanonicalForm form(name);
+
+  /* decides the calling convention */
+  form.add(is_exported(st) ? "exported" : "internal");
+  form.add((int)type);
+  for (AttributeVector::iterator i = attributes.begin();
+       i != attributes.end(); i++){
+    const std::vector<std::string>& a = (*i)->get_arguments();
+    form.add("attribute");
+    form.add((*i)->get_name());
+    form.add((int)a.size());
+    for (std::vector<std::string>::const_iterator j = a.begin();
+         j != a.end(); j++){
+      form.add(*j);
+    }
+  }
+  form.add((int)arguments.size());
+  for (ArgumentVector::iterator i = arguments.begin();
+       i != arguments.end(); i++){
+    form.add((int)(*i)->get_type());
+    form.declare((*i)->get_name());
+  }
+  contents->canonicalize(form);
+  return form.get_text();
+}
+/*
+ * Makes the function an alias of original, whose body has the same
+ * form: calls generated from now on and the host go to the code of
+ * original directly. f only forwards, for earlier calls and for
+ * linking against the name.
+ */
+void FunctionDefinition::share_body(llvm::Function* f, SymbolTable* st,
+                                    const std::string& original){
+  Function* entry = st->find_function(name);
+  Function& shared = st->get_function(original);
+  llvm::Function* code = shared.get_address();
+
+  llvm::LLVMBuilder builder(new llvm::BasicBlock("entry", f));
+  std::vector<llvm::Value*> a;
+  llvm::Function::arg_iterator j = f->arg_begin();
+  for (ArgumentVector::iterator i = arguments.begin();
+       i != arguments.end(); i++, j++){
+    j->setName((*i)->get_name());
+    a.push_back(j);
+  }
+  llvm::CallInst* call = builder.CreateCall(code, a.begin(), a.end(), "rv");
+  call->setCallingConv(code->getCallingConv());
+  call->setTailCall();
+  builder.CreateRet(call);
+
+  entry->set_address(code);
+  if (shared.get_reads_globals()){
+    entry->note_global_read();
+  }
+  if (shared.get_writes_globals()){
+    entry->note_global_write();
+  }
+  for (std::set<std::string>::const_iterator i = 
+         shared.get_callees().begin();
+       i != shared.get_callees().end(); i++){
+    entry->note_call(*i);
+  }
+  st->get_function_table()->note_shared();
+}
+FunctionBody* FunctionDefinition::generate_prolog(llvm::Module* module,
+                                                  SymbolTable* st){
+  Function* old = st->find_function(name);
+  Function previous = old ? *old : Function();
+  llvm::Function* existing = module->getFunction(name);
+  unsigned int previous_cc = existing ? existing->getCallingConv() 
+    : llvm::CallingConv::C;
+  llvm::Function* f = define(module, st);
+  FunctionBody* body;
+
+  try {
+    body = begin_body(f, st);
+  } catch (std::exception* e){
+    undefine(f, st, old ? &previous : NULL, previous_cc);
+    throw;
+  }
+  body->had_previous = (old != NULL);
+  body->previous = previous;
+  body->previous_cc = previous_cc;
+  return body;
+}
+void FunctionDefinition::generate_epilog(FunctionBody* body){
+  end_body(body);
+}
+void FunctionDefinition::discard_body(FunctionBody* body, SymbolTable* st){
+  llvm::Function* f = body->function;
+  Function previous = body->previous;
+  bool had_previous = body->had_previous;
+  unsigned int previous_cc = body->previous_cc;
+
+  delete body;
+  undefine(f, st, had_previous ? &previous : NULL, previous_cc);
+}
+/*
+ * Takes back what define() did: the function becomes the prototype it
+ * was before, or disappears if nothing refers to it.
+ */
+void FunctionDefinition::undefine(llvm::Function* f, SymbolTable* st,
+                                  Function* previous, 
+                                  unsigned int previous_cc){
+  f->deleteBody();
+  set_calling_conv(f, previous_cc);
+  forget_target_clones(f->getParent(), name);
+  if (previous){
+    st->put_function(name, *previous);
+  } else {
+    st->get_function_table()->remove_function(name);
+    if (f->use_empty()){
+      f->eraseFromParent();
+    }
+  }
+}
+/* creates or completes the function and enters it in the symbol table */
+llvm::Function* FunctionDefinition::define(llvm::Module* module,
+                                           SymbolTable* st){
   std::vector<const llvm::Type*> arg_types;
   std::vector<ValueType> arg_vtypes;
+
+  Attribute* clones = get_attribute("target_clones");
+  std::vector<std::string> isas;
+
+  check_attributes(attributes, true);
+  if (clones){
+    isas = clone_targets(clones);
+  }
   for (ArgumentVector::iterator i = arguments.begin();
        i != arguments.end(); i++){
     arg_types.push_back(llvm_type((*i)->get_type()));
@@ -753,25 +1451,138 @@ void FunctionDefinition::generate(llvm::Module* module,
   llvm::FunctionType* t = llvm::FunctionType::get(llvm_type(type), 
                                                   arg_types, 
                                                   false);
-  llvm::Function* f = 
-    new llvm::Function(t, 
-                       llvm::GlobalValue::ExternalLinkage,
-                       name,
-                       module);
+  check_builtin_unused(name, module, st);
+  llvm::Function* f = module->getFunction(name);
+  if (f){
+    /* complete an earlier prototype, so that existing calls see the body */
+    if (!f->isDeclaration()){
+      throw new SymbolRedefined(name);
+    }
+    if (f->getFunctionType() != t){
+      throw new IncompatibleTypes();
+    }
+  } else {
+    f = new llvm::Function(t, 
+                           llvm::GlobalValue::ExternalLinkage,
+                           name,
+                           module);
+  }
+
+  if (!is_exported(st)){
+    f->setLinkage(llvm::GlobalValue::InternalLinkage);
+    set_calling_conv(f, llvm::CallingConv::Fast);
+  }
 
+  Function* old = st->find_function(name);
+  llvm::GlobalVariable* cell = old ? old->get_cell() : NULL;
   st->put_function(name, Function(type, arg_vtypes, f));
+  st->find_function(name)->set_cell(cell);
+  st->find_function(name)->set_defined();
+  if (name == "main" || get_attribute("export")){
+    st->find_function(name)->set_exported();
+  }
+  if (clones){
+    note_target_clones(module, name, isas);
+  } else {
+    forget_target_clones(module, name);
+  }
+  if (st->get_options().uses_cells()){
+    function_cell(*st->find_function(name));
+  }
+  return f;
+}
+/*
+ * Generates the body into a new function next to the current one, with
+ * the same signature, to be put into the cell of the function.
+ */
+llvm::Function* FunctionDefinition::generate_version(llvm::Module* module,
+                                                     SymbolTable* st,
+                                                     const std::string& version){
+  Function* entry = st->find_function(name);
+
+  check_attributes(attributes, true);
+  if (!entry || !entry->is_defined()){
+    throw new UnknownSymbol(name);
+  }
+  if (entry->get_ret_type() != type 
+      || entry->get_arg_types() != get_arg_types()){
+    throw new IncompatibleTypes();
+  }
+
+  llvm::Function* current = entry->get_address();
+  llvm::Function* f = new llvm::Function(current->getFunctionType(),
+                                         llvm::GlobalValue::InternalLinkage,
+                                         version,
+                                         module);
+  f->setCallingConv(current->getCallingConv());
+  try {
+    generate_body(f, st);
+  } catch (std::exception* e){
+    /* nothing refers to the version yet */
+    f->eraseFromParent();
+    throw;
+  }
+  return f;
+}
+/*
+ * In whole program mode only main() and [[export]]ed functions are
+ * visible outside the module, everything else can use the fast calling
+ * convention and be freely rewritten by interprocedural passes.
+ */
+bool FunctionDefinition::is_exported(SymbolTable* st){
+  return !st->get_options().whole_program 
+    || name == "main" 
+    || get_attribute("export");
+}
+void FunctionDefinition::generate_body(llvm::Function* f,
+                                       SymbolTable* st){
+  FunctionBody* body = begin_body(f, st);
+  try {
+    contents->generate(body->builder, body->symbols);
+  } catch (std::exception* e){
+    delete body;
+    throw;
+  }
+  end_body(body);
+}
+/* everything up to the first statement of the body */
+FunctionBody* FunctionDefinition::begin_body(llvm::Function* f,
+                                             SymbolTable* st){
+  Attribute* fp_model = get_attribute("fp_model");
+  Profile* profile = st->get_options().profile;
+  FPModel lex_fp_model = st->get_lex_fp_model();
+
+  /* before anything is allocated */
+  if (fp_model){
+    if (fp_model->get_arguments().size() != 1){
+      throw new InvalidAttributeArguments(fp_model->get_name());
+    }
+    lex_fp_model = get_fp_model(fp_model->get_arguments()[0]);
+  }
 
   llvm::BasicBlock* entry = new llvm::BasicBlock("entry", f);
-  llvm::LLVMBuilder builder(entry);
+  FunctionBody* body = new FunctionBody(f, entry);
+  llvm::LLVMBuilder& builder = body->builder;
 
   llvm::Value* rvp = builder.CreateAlloca(llvm_type(type), 0, "retval");
+  if (profile){
+    profile->begin_function(f, builder);
+  }
 
   llvm::BasicBlock* epilog = new llvm::BasicBlock("epilog", f);
   llvm::LLVMBuilder epbuilder(epilog);
   llvm::Value* rv = epbuilder.CreateLoad(rvp);
   epbuilder.CreateRet(rv);
 
-  SymbolTable fst(st, type, rvp, epilog);
+  body->epilog = epilog;
+  body->symbols = new SymbolTable(st, type, rvp, epilog);
+  SymbolTable& fst = *body->symbols;
+  fst.set_lex_function(st->find_function(name));
+  if (profile && profile->is_generating()){
+    /* counters are global state as well */
+    fst.get_lex_function()->note_global_write();
+  }
+  fst.set_lex_fp_model(lex_fp_model);
 
   llvm::Function::arg_iterator j = f->arg_begin();
   for (ArgumentVector::iterator i = arguments.begin();
@@ -785,6 +1596,26 @@ void FunctionDefinition::generate(llvm::Module* module,
     fst.put_symbol((*i)->get_name(), Variable(ptr, (*i)->get_type()));
   }
 
-  contents->generate(builder, &fst);
-  builder.CreateBr(epilog);
+  Specializer* specializer = st->get_options().specializer;
+  if (specializer && f == fst.get_lex_function()->get_address()){
+    if (specializer->instrument(builder, f, fst.get_lex_function())){
+      fst.get_lex_function()->note_global_write();
+    }
+  }
+
+  return body;
 }
+void FunctionDefinition::end_body(FunctionBody* body){
+  Profile* profile = body->symbols->get_options().profile;
+  Specializer* specializer = body->symbols->get_options().specializer;
+
+  body->builder.CreateBr(body->epilog);
+  if (profile){
+    profile->end_function(body->function);
+  }
+  if (specializer){
+    specializer->add_dispatch(body->function);
+  }
+  delete body;
+}
+
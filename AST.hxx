@@ -10,8 +10,36 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 namespace ncc {
+  /*
+   * Text describing the structure of a function body independent of the
+   * names it uses for itself, its arguments and locals. Types, operators,
+   * literals, globals and callees are kept, so equal forms compile to the
+   * same code.
+   */
+  class CanonicalForm {
+  protected:
+    std::string text;
+    std::map<std::string, int> locals;
+    int next_local;
+    std::string self;
+  public:
+    CanonicalForm(const std::string& self) : next_local(0), self(self) {}
+    void add(const char* s);
+    void add(int n);
+    void add(double d);
+    void add(const std::string& s);
+    /* a new local or argument, later references use its number */
+    void declare(const std::string& name);
+    void reference(const std::string& name);
+    void call(const std::string& name);
+    const std::string& get_text(){
+      return text;
+    }
+  };
+
   class ASTNode {
   public:
     virtual void print(std::ostream& stream, int indent) = 0;
@@ -23,6 +51,7 @@ namespace ncc {
     virtual ~Statement();
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st) = 0;
+    virtual void canonicalize(CanonicalForm& form) = 0;
   };
   typedef std::vector<Statement *> StatementVector;
 
@@ -43,6 +72,7 @@ namespace ncc {
       left(left), right(right), op(op) {};
     virtual ~BinaryOperation();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
 
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
@@ -60,6 +90,7 @@ namespace ncc {
       left(left), right(right), op(op) {};
     virtual ~ShortCircuitOperation();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -75,6 +106,7 @@ namespace ncc {
       cond(cond), cons(cons), alt(alt) {}
     virtual ~ConditionalExpression();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -91,6 +123,7 @@ namespace ncc {
                Expression* value) : variable(variable), op(op), value(value) {}
     virtual ~Assignment();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -104,6 +137,7 @@ namespace ncc {
     UnaryOperation(Expression* e, UnaryOperator op): expr(e), op(op) {};
     virtual ~UnaryOperation();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -120,6 +154,7 @@ namespace ncc {
 
     virtual ~FunCall();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -132,6 +167,7 @@ namespace ncc {
     VariableReference(const std::string& name) : name(name){}
     virtual ~VariableReference();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     const std::string& get_name(){
       return name;
     }
@@ -147,6 +183,7 @@ namespace ncc {
     IntegerLiteral(int value):value(value){}
     virtual ~IntegerLiteral();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -159,6 +196,10 @@ namespace ncc {
     DoubleLiteral(double value): value(value) {}
     virtual ~DoubleLiteral();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
+    double get_value(){
+      return value;
+    }
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -171,6 +212,7 @@ namespace ncc {
     StringLiteral(const std::string& value): value(value) {}
     virtual ~StringLiteral();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
     virtual ValueType get_type(SymbolTable* st);
@@ -183,6 +225,7 @@ namespace ncc {
     Block(const StatementVector& statements): statements(statements) {}
     virtual ~Block();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
   };
@@ -197,6 +240,7 @@ namespace ncc {
       cond(cond), cons(cons), alt(alt) {}
     virtual ~ConditionalStatement();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
   };
@@ -208,6 +252,7 @@ namespace ncc {
     ReturnStatement(Expression* expr): expr(expr) {};
     virtual ~ReturnStatement();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
   };
@@ -220,6 +265,7 @@ namespace ncc {
       cond(cond), body(body) {}
     virtual ~WhileStatement();
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
   };
@@ -241,6 +287,7 @@ namespace ncc {
       type(type), name(name), value(value) {}
     virtual ~LocalVariable();    
     virtual void print(std::ostream& stream, int indent);
+    virtual void canonicalize(CanonicalForm& form);
     virtual llvm::Value* generate(llvm::LLVMBuilder& builder,
                                   SymbolTable* st);
   };
@@ -255,6 +302,9 @@ namespace ncc {
                        Expression* value): 
       type(type), name(name), value(value) {}
     virtual ~GlobalVariable();    
+    const std::string& get_name(){
+      return name;
+    }
     virtual void print(std::ostream& stream, int indent);
     virtual void generate(llvm::Module* module,
                           SymbolTable* st);
@@ -278,30 +328,112 @@ namespace ncc {
   };
   typedef std::vector<Argument*> ArgumentVector;
 
+  class Attribute : public ASTNode {
+  protected:
+    std::string name;
+    std::vector<std::string> arguments;
+  public:
+    Attribute(const std::string& name, 
+              const std::vector<std::string>& arguments):
+      name(name), arguments(arguments) {}
+    virtual void print(std::ostream& stream, int indent);
+    const std::string& get_name(){
+      return name;
+    }
+    const std::vector<std::string>& get_arguments(){
+      return arguments;
+    }
+  };
+  typedef std::vector<Attribute*> AttributeVector;
+
   class FunctionDeclaration : public TopLevelForm {
   protected:
     ValueType type;
     std::string name;
     ArgumentVector arguments;
+    AttributeVector attributes;
+    Attribute* get_attribute(const std::string& name);
   public:
-    FunctionDeclaration(ValueType type, std::string name, ArgumentVector arguments):
-      type(type), name(name), arguments(arguments) {};
+    FunctionDeclaration(ValueType type, std::string name, ArgumentVector arguments,
+                        AttributeVector attributes):
+      type(type), name(name), arguments(arguments), attributes(attributes) {};
     virtual ~FunctionDeclaration();
+    const std::string& get_name(){
+      return name;
+    }
+    ValueType get_type(){
+      return type;
+    }
+    std::vector<ValueType> get_arg_types();
+    bool has_attribute(const std::string& name){
+      return get_attribute(name) != NULL;
+    }
     virtual void print(std::ostream& stream, int indent);
     virtual void generate(llvm::Module* module,
                           SymbolTable* st);
   };
+  /*
+   * Code generation state of a function body between its prolog and
+   * epilog, statements can be added one at a time.
+   */
+  class FunctionBody {
+  protected:
+    llvm::Function* function;
+    llvm::LLVMBuilder builder;
+    SymbolTable* symbols;
+    llvm::BasicBlock* epilog;
+    /* what define() replaced, to go back to if the body fails */
+    bool had_previous;
+    Function previous;
+    unsigned int previous_cc;
+    friend class FunctionDefinition;
+  public:
+    FunctionBody(llvm::Function* function, llvm::BasicBlock* entry):
+      function(function), builder(entry), symbols(NULL), epilog(NULL),
+      had_previous(false), previous_cc(0) {};
+    ~FunctionBody(){
+      delete symbols;
+    }
+    void generate(Statement* s){
+      s->generate(builder, symbols);
+    }
+  };
+
   class FunctionDefinition : public FunctionDeclaration {
   protected:
     Block* contents;
+    bool is_exported(SymbolTable* st);
+    std::string canonical_form(SymbolTable* st);
+    bool can_share(SymbolTable* st);
+    void share_body(llvm::Function* f, SymbolTable* st,
+                    const std::string& original);
+    llvm::Function* define(llvm::Module* module, SymbolTable* st);
+    FunctionBody* begin_body(llvm::Function* f, SymbolTable* st);
+    void end_body(FunctionBody* body);
+    void undefine(llvm::Function* f, SymbolTable* st, 
+                  Function* previous, unsigned int previous_cc);
+    void generate_body(llvm::Function* f, SymbolTable* st);
   public:
     FunctionDefinition(ValueType type, std::string name, ArgumentVector arguments,
-                       Block* contents): 
-      FunctionDeclaration(type, name, arguments), contents(contents) {};
+                       AttributeVector attributes, Block* contents): 
+      FunctionDeclaration(type, name, arguments, attributes), 
+      contents(contents) {};
     virtual ~FunctionDefinition();
     virtual void print(std::ostream& stream, int indent);
     virtual void generate(llvm::Module* module,
                           SymbolTable* st);
+    /*
+     * Direct code generation for a definition constructed without
+     * contents: the parser feeds each statement to the returned body
+     * and finishes it with generate_epilog(). generate() then has
+     * nothing left to do.
+     */
+    FunctionBody* generate_prolog(llvm::Module* module, SymbolTable* st);
+    void generate_epilog(FunctionBody* body);
+    /* undoes generate_prolog() after an error in the body */
+    void discard_body(FunctionBody* body, SymbolTable* st);
+    llvm::Function* generate_version(llvm::Module* module, SymbolTable* st,
+                                     const std::string& version);
   }; 
 }
 
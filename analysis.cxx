@@ -0,0 +1,199 @@
+#include "analysis.hxx"
+
+#include "llvm/Instructions.h"
+
+#include <vector>
+
+using namespace ncc;
+
+/*
+ * Classifies every defined function as pure (touches no global state),
+ * read-only or side-effecting, from the global accesses and calls noted
+ * during code generation. Mutually recursive functions share one
+ * classification, so the call graph is walked in strongly connected
+ * components, callees first (Tarjan).
+ *
+ * ncc code itself cannot unwind, only external functions might, so
+ * nounwind propagates the same way.
+ */
+
+enum Effect {
+  EFFECT_NONE,
+  EFFECT_READ,
+  EFFECT_WRITE
+};
+
+struct FunctionInfo {
+  Function* function;
+  int index;
+  int lowlink;
+  bool on_stack;
+  Effect effect;
+  bool may_unwind;
+};
+
+class AttributeInference {
+protected:
+  FunctionTable* ft;
+  std::map<std::string, FunctionInfo> info;
+  std::vector<FunctionInfo*> stack;
+  int next_index;
+
+  void visit(FunctionInfo* fi);
+  void finish_component(FunctionInfo* root);
+  FunctionInfo* get_info(const std::string& name){
+    std::map<std::string, FunctionInfo>::iterator i = info.find(name);
+    if (i == info.end()){
+      return NULL;
+    }
+    return &i->second;
+  }
+public:
+  AttributeInference(FunctionTable* ft);
+  void run();
+  void apply();
+};
+
+AttributeInference::AttributeInference(FunctionTable* ft) : ft(ft),
+                                                            next_index(0){
+  for (FunctionTable::iterator i = ft->begin(); i != ft->end(); i++){
+    FunctionInfo& fi = info[i->first];
+    fi.function = &i->second;
+    fi.index = -1;
+    fi.lowlink = -1;
+    fi.on_stack = false;
+    if (i->second.is_defined()){
+      fi.effect = EFFECT_NONE;
+      fi.may_unwind = false;
+    } else {
+      fi.effect = EFFECT_WRITE;
+      fi.may_unwind = true;
+    }
+  }
+}
+
+void AttributeInference::run(){
+  for (std::map<std::string, FunctionInfo>::iterator i = info.begin();
+       i != info.end(); i++){
+    if (i->second.index < 0 && i->second.function->is_defined()){
+      visit(&i->second);
+    }
+  }
+}
+
+void AttributeInference::visit(FunctionInfo* fi){
+  fi->index = fi->lowlink = next_index++;
+  stack.push_back(fi);
+  fi->on_stack = true;
+
+  const std::set<std::string>& callees = fi->function->get_callees();
+  for (std::set<std::string>::const_iterator i = callees.begin();
+       i != callees.end(); i++){
+    FunctionInfo* callee = get_info(*i);
+    if (!callee || !callee->function->is_defined()){
+      continue;
+    }
+    if (callee->index < 0){
+      visit(callee);
+      if (callee->lowlink < fi->lowlink){
+        fi->lowlink = callee->lowlink;
+      }
+    } else if (callee->on_stack && callee->index < fi->lowlink){
+      fi->lowlink = callee->index;
+    }
+  }
+
+  if (fi->lowlink == fi->index){
+    finish_component(fi);
+  }
+}
+
+void AttributeInference::finish_component(FunctionInfo* root){
+  std::vector<FunctionInfo*> component;
+  FunctionInfo* member;
+  Effect effect = EFFECT_NONE;
+  bool may_unwind = false;
+
+  do {
+    member = stack.back();
+    stack.pop_back();
+    member->on_stack = false;
+    component.push_back(member);
+  } while (member != root);
+
+  for (std::vector<FunctionInfo*>::iterator i = component.begin();
+       i != component.end(); i++){
+    Function* f = (*i)->function;
+    if (f->get_writes_globals()){
+      effect = EFFECT_WRITE;
+    } else if (f->get_reads_globals() && effect < EFFECT_READ){
+      effect = EFFECT_READ;
+    }
+
+    const std::set<std::string>& callees = f->get_callees();
+    for (std::set<std::string>::const_iterator j = callees.begin();
+         j != callees.end(); j++){
+      FunctionInfo* callee = get_info(*j);
+      if (!callee){
+        effect = EFFECT_WRITE;
+        may_unwind = true;
+        continue;
+      }
+      /* members of this component still hold neutral initial values */
+      if (callee->effect > effect){
+        effect = callee->effect;
+      }
+      may_unwind = may_unwind || callee->may_unwind;
+    }
+  }
+
+  for (std::vector<FunctionInfo*>::iterator i = component.begin();
+       i != component.end(); i++){
+    (*i)->effect = effect;
+    (*i)->may_unwind = may_unwind;
+  }
+}
+
+static void apply_to_calls(llvm::Function* f, Effect effect, bool may_unwind){
+  for (llvm::Value::use_iterator i = f->use_begin(); 
+       i != f->use_end(); i++){
+    llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(*i);
+    if (!call){
+      continue;
+    }
+    if (effect == EFFECT_NONE){
+      call->setDoesNotAccessMemory();
+    } else if (effect == EFFECT_READ){
+      call->setOnlyReadsMemory();
+    }
+    if (!may_unwind){
+      call->setDoesNotThrow();
+    }
+  }
+}
+
+void AttributeInference::apply(){
+  for (std::map<std::string, FunctionInfo>::iterator i = info.begin();
+       i != info.end(); i++){
+    FunctionInfo& fi = i->second;
+    llvm::Function* f = fi.function->get_address();
+    if (!fi.function->is_defined()){
+      continue;
+    }
+    if (fi.effect == EFFECT_NONE){
+      f->setDoesNotAccessMemory();
+    } else if (fi.effect == EFFECT_READ){
+      f->setOnlyReadsMemory();
+    }
+    if (!fi.may_unwind){
+      f->setDoesNotThrow();
+    }
+    apply_to_calls(f, fi.effect, fi.may_unwind);
+  }
+}
+
+void ncc::infer_function_attributes(FunctionTable* ft){
+  AttributeInference ai(ft);
+  ai.run();
+  ai.apply();
+}
@@ -0,0 +1,10 @@
+#ifndef HXX__ncc__analysis__
+#define HXX__ncc__analysis__
+
+#include "symbol.hxx"
+
+namespace ncc {
+  void infer_function_attributes(FunctionTable* ft);
+}
+
+#endif
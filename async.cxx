@@ -0,0 +1,352 @@
+#include "async.hxx"
+#include "exceptions.hxx"
+
+#include <time.h>
+#include <sched.h>
+
+using namespace ncc;
+
+enum TaskState {
+  TASK_QUEUED,
+  TASK_RUNNING,
+  TASK_DONE,
+  TASK_FAILED,
+  TASK_CANCELLED
+};
+
+/* shared by the futures of a request and the pool while it has it */
+struct ncc::CompileTask {
+  std::string source;
+  std::string function;
+  CompilePriority priority;
+  /* while queued, cleared under the mutex when the task leaves it */
+  AsyncCompiler* pool;
+  pthread_mutex_t mutex;
+  pthread_cond_t finished;
+  TaskState state;
+  void* result;
+  std::string error;
+  double submitted;
+  int refs;
+};
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void retain(CompileTask* task){
+  __sync_fetch_and_add(&task->refs, 1);
+}
+
+static void release(CompileTask* task){
+  if (__sync_sub_and_fetch(&task->refs, 1) == 0){
+    pthread_cond_destroy(&task->finished);
+    pthread_mutex_destroy(&task->mutex);
+    delete task;
+  }
+}
+
+/* moves a task out of the queued or running state */
+static void finish(CompileTask* task, TaskState state){
+  pthread_mutex_lock(&task->mutex);
+  task->state = state;
+  pthread_cond_broadcast(&task->finished);
+  pthread_mutex_unlock(&task->mutex);
+}
+
+CompileFuture::CompileFuture(CompileTask* task) : task(task){
+  retain(task);
+}
+
+CompileFuture::CompileFuture(const CompileFuture& other) : task(other.task){
+  retain(task);
+}
+
+CompileFuture& CompileFuture::operator=(const CompileFuture& other){
+  retain(other.task);
+  release(task);
+  task = other.task;
+  return *this;
+}
+
+CompileFuture::~CompileFuture(){
+  release(task);
+}
+
+bool CompileFuture::is_ready(){
+  bool ready;
+  pthread_mutex_lock(&task->mutex);
+  ready = task->state != TASK_QUEUED && task->state != TASK_RUNNING;
+  pthread_mutex_unlock(&task->mutex);
+  return ready;
+}
+
+void* CompileFuture::get(){
+  pthread_mutex_lock(&task->mutex);
+  while (task->state == TASK_QUEUED || task->state == TASK_RUNNING){
+    pthread_cond_wait(&task->finished, &task->mutex);
+  }
+  TaskState state = task->state;
+  pthread_mutex_unlock(&task->mutex);
+
+  if (state == TASK_CANCELLED){
+    throw new CompileError("compilation cancelled");
+  } else if (state == TASK_FAILED){
+    throw new CompileError(task->error);
+  }
+  return task->result;
+}
+
+bool CompileFuture::cancel(){
+  for (;;){
+    pthread_mutex_lock(&task->mutex);
+    AsyncCompiler* pool = task->pool;
+    if (!pool || task->state != TASK_QUEUED){
+      pthread_mutex_unlock(&task->mutex);
+      return false;
+    }
+    /* 
+     * The pool locks its queue before tasks. While the task is held it
+     * stays queued and the pool alive, so only try for the queue and
+     * back off otherwise.
+     */
+    if (pthread_mutex_trylock(&pool->mutex) == 0){
+      pool->remove(task);
+      task->state = TASK_CANCELLED;
+      task->pool = NULL;
+      pthread_cond_broadcast(&task->finished);
+      pthread_mutex_unlock(&pool->mutex);
+      pthread_mutex_unlock(&task->mutex);
+      /* the queue's reference */
+      release(task);
+      return true;
+    }
+    pthread_mutex_unlock(&task->mutex);
+    sched_yield();
+  }
+}
+
+AsyncCompiler::AsyncCompiler(Compiler* compiler, int threads,
+                             size_t max_queued) : compiler(compiler),
+                                                  max_queued(max_queued),
+                                                  stopping(false){
+  /* the host runs code while workers add more to the session */
+  compiler->set_lazy(false);
+  compiler->set_auto_trim(false);
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&work, NULL);
+  pthread_cond_init(&space, NULL);
+  stats.submitted = 0;
+  stats.completed = 0;
+  stats.failed = 0;
+  stats.cancelled = 0;
+  stats.queue_depth = 0;
+  stats.max_queue_depth = 0;
+  stats.total_wait = 0;
+  stats.max_wait = 0;
+  stats.total_compile = 0;
+  stats.max_compile = 0;
+
+  for (int i = 0; i < threads; i++){
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, this) != 0){
+      break;
+    }
+    this->threads.push_back(t);
+  }
+  if (this->threads.empty()){
+    throw new CompileError("cannot start compiler threads");
+  }
+}
+
+AsyncCompiler::~AsyncCompiler(){
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  for (int p = 0; p < PRIORITY_COUNT; p++){
+    for (std::deque<CompileTask*>::iterator i = queues[p].begin();
+         i != queues[p].end(); i++){
+      pthread_mutex_lock(&(*i)->mutex);
+      (*i)->state = TASK_CANCELLED;
+      (*i)->pool = NULL;
+      pthread_cond_broadcast(&(*i)->finished);
+      pthread_mutex_unlock(&(*i)->mutex);
+      stats.cancelled++;
+      release(*i);
+    }
+    queues[p].clear();
+  }
+  stats.queue_depth = 0;
+  pthread_cond_broadcast(&work);
+  pthread_cond_broadcast(&space);
+  pthread_mutex_unlock(&mutex);
+
+  for (std::vector<pthread_t>::iterator i = threads.begin();
+       i != threads.end(); i++){
+    pthread_join(*i, NULL);
+  }
+  pthread_cond_destroy(&space);
+  pthread_cond_destroy(&work);
+  pthread_mutex_destroy(&mutex);
+}
+
+CompileFuture AsyncCompiler::submit(const std::string& source,
+                                    const std::string& function,
+                                    CompilePriority priority){
+  CompileTask* task = new CompileTask;
+  task->source = source;
+  task->function = function;
+  task->priority = priority;
+  task->pool = this;
+  pthread_mutex_init(&task->mutex, NULL);
+  pthread_cond_init(&task->finished, NULL);
+  task->state = TASK_QUEUED;
+  task->result = NULL;
+  task->submitted = now_ns();
+  /* the pool's reference */
+  task->refs = 1;
+  CompileFuture future(task);
+
+  pthread_mutex_lock(&mutex);
+  while (stats.queue_depth >= max_queued && !stopping){
+    pthread_cond_wait(&space, &mutex);
+  }
+  if (stopping){
+    pthread_mutex_unlock(&mutex);
+    task->pool = NULL;
+    finish(task, TASK_CANCELLED);
+    release(task);
+    return future;
+  }
+  queues[priority].push_back(task);
+  stats.submitted++;
+  stats.queue_depth++;
+  if (stats.queue_depth > stats.max_queue_depth){
+    stats.max_queue_depth = stats.queue_depth;
+  }
+  pthread_cond_signal(&work);
+  pthread_mutex_unlock(&mutex);
+  return future;
+}
+
+/* takes a cancelled task out of its queue, the caller holds the mutex */
+void AsyncCompiler::remove(CompileTask* task){
+  std::deque<CompileTask*>& queue = queues[task->priority];
+  for (std::deque<CompileTask*>::iterator i = queue.begin();
+       i != queue.end(); i++){
+    if (*i == task){
+      queue.erase(i);
+      stats.queue_depth--;
+      stats.cancelled++;
+      pthread_cond_signal(&space);
+      return;
+    }
+  }
+}
+
+/* waits for the most urgent task, NULL once the pool stops */
+CompileTask* AsyncCompiler::next_task(){
+  CompileTask* task = NULL;
+
+  pthread_mutex_lock(&mutex);
+  while (!task){
+    for (int p = PRIORITY_COUNT - 1; p >= 0 && !task; p--){
+      if (!queues[p].empty()){
+        task = queues[p].front();
+        queues[p].pop_front();
+      }
+    }
+    if (task){
+      stats.queue_depth--;
+      pthread_cond_signal(&space);
+      pthread_mutex_lock(&task->mutex);
+      task->pool = NULL;
+      task->state = TASK_RUNNING;
+      pthread_mutex_unlock(&task->mutex);
+    } else if (stopping){
+      break;
+    } else {
+      pthread_cond_wait(&work, &mutex);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return task;
+}
+
+void AsyncCompiler::run(CompileTask* task){
+  double start = now_ns();
+  TaskState state = TASK_DONE;
+
+  try {
+    if (!task->source.empty()){
+      compiler->compile(task->source);
+    }
+    if (!task->function.empty()){
+      task->result = compiler->get_function_pointer(task->function);
+    }
+  } catch (ParseError* e){
+    task->error = std::string("parse error at ") + e->what();
+    state = TASK_FAILED;
+  } catch (std::exception* e){
+    task->error = e->what();
+    state = TASK_FAILED;
+  } catch (...){
+    task->error = "unexpected exception";
+    state = TASK_FAILED;
+  }
+
+  double end = now_ns();
+  pthread_mutex_lock(&mutex);
+  if (state == TASK_DONE){
+    stats.completed++;
+  } else {
+    stats.failed++;
+  }
+  stats.total_wait += start - task->submitted;
+  if (start - task->submitted > stats.max_wait){
+    stats.max_wait = start - task->submitted;
+  }
+  stats.total_compile += end - start;
+  if (end - start > stats.max_compile){
+    stats.max_compile = end - start;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  finish(task, state);
+}
+
+void* AsyncCompiler::worker(void* arg){
+  AsyncCompiler* pool = (AsyncCompiler*)arg;
+  CompileTask* task;
+  while ((task = pool->next_task())){
+    pool->run(task);
+    release(task);
+  }
+  return NULL;
+}
+
+AsyncCompileStats AsyncCompiler::get_stats(){
+  AsyncCompileStats s;
+  pthread_mutex_lock(&mutex);
+  s = stats;
+  pthread_mutex_unlock(&mutex);
+  return s;
+}
+
+void AsyncCompiler::print_stats(std::ostream& stream){
+  AsyncCompileStats s = get_stats();
+  unsigned long n = s.completed + s.failed;
+
+  stream << "Async compiles: " << s.submitted << " submitted, "
+         << s.completed << " completed, " << s.failed << " failed, "
+         << s.cancelled << " cancelled" << std::endl;
+  stream << "Queue depth: " << s.queue_depth << " now, "
+         << s.max_queue_depth << " at most" << std::endl;
+  if (n){
+    stream << "Wait (ms): average " << s.total_wait / n / 1e6
+           << " max " << s.max_wait / 1e6 << std::endl;
+    stream << "Compile (ms): average " << s.total_compile / n / 1e6
+           << " max " << s.max_compile / 1e6 << std::endl;
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef HXX__ncc__async__
+#define HXX__ncc__async__
+
+#include "compiler.hxx"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <pthread.h>
+
+namespace ncc {
+  /* higher priorities are taken from the queue first */
+  enum CompilePriority {
+    PRIORITY_BULK,
+    PRIORITY_NORMAL,
+    PRIORITY_INTERACTIVE,
+    PRIORITY_COUNT
+  };
+
+  struct CompileTask;
+
+  /*
+   * Handle to the result of an asynchronous compile, the address of the
+   * requested function once it is ready. Copies share the same result.
+   */
+  class CompileFuture {
+  protected:
+    CompileTask* task;
+  public:
+    CompileFuture(CompileTask* task);
+    CompileFuture(const CompileFuture& other);
+    CompileFuture& operator=(const CompileFuture& other);
+    ~CompileFuture();
+
+    bool is_ready();
+    /* waits, throws CompileError if compiling failed or was cancelled */
+    void* get();
+    /* 
+     * Only succeeds while the request is still queued, it then gives
+     * up its place in the queue at once.
+     */
+    bool cancel();
+  };
+
+  struct AsyncCompileStats {
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long cancelled;
+    unsigned long queue_depth;
+    unsigned long max_queue_depth;
+    /* nanoseconds spent in the queue and compiling */
+    double total_wait;
+    double max_wait;
+    double total_compile;
+    double max_compile;
+  };
+
+  /*
+   * A pool of threads compiling sources into one session in the
+   * background. At most max_queued requests wait at a time, submit()
+   * blocks while the queue is full. Code generation is serialized across
+   * the process, so more threads mostly overlap parsing. The session
+   * is made eager, so that code the host runs never compiles callees
+   * lazily while workers generate into the same module.
+   */
+  class AsyncCompiler {
+  protected:
+    Compiler* compiler;
+    size_t max_queued;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    std::deque<CompileTask*> queues[PRIORITY_COUNT];
+    bool stopping;
+    AsyncCompileStats stats;
+
+    CompileTask* next_task();
+    void remove(CompileTask* task);
+    void run(CompileTask* task);
+    static void* worker(void* arg);
+    friend class CompileFuture;
+  public:
+    AsyncCompiler(Compiler* compiler, int threads, size_t max_queued = 256);
+    /* cancels what is still queued and waits for the rest */
+    ~AsyncCompiler();
+
+    /* function may be empty to only add the source to the session */
+    CompileFuture submit(const std::string& source,
+                         const std::string& function,
+                         CompilePriority priority = PRIORITY_NORMAL);
+    AsyncCompileStats get_stats();
+    void print_stats(std::ostream& stream);
+  };
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "async.hxx"
+#include "lock.hxx"
+#include "exceptions.hxx"
+
+#include <iostream>
+#include <sched.h>
+
+/*
+ * Test program for AsyncCompiler. One worker is held up in code
+ * generation while requests of every priority queue up, so the order
+ * they are compiled in is known. Returns 0 on success.
+ */
+
+static int failures = 0;
+
+static void check(bool ok, const char* what){
+  if (!ok){
+    std::cerr << "asynctest: " << what << " failed" << std::endl;
+    failures++;
+  }
+}
+
+static int call(void* code){
+  union {
+    void* object;
+    int (*function)();
+  } p;
+  p.object = code;
+  return p.function();
+}
+
+static bool fails(ncc::CompileFuture& future){
+  try {
+    future.get();
+  } catch (ncc::CompileError* e){
+    delete e;
+    return true;
+  }
+  return false;
+}
+
+int main(){
+  ncc::CodegenOptions options;
+  ncc::Compiler compiler(options);
+  ncc::AsyncCompiler pool(&compiler, 1);
+
+  /* the worker takes the first request and waits for the lock */
+  ncc::LLVMLock* hold = new ncc::LLVMLock;
+  ncc::CompileFuture first = pool.submit("int first(){ return 1; }", "",
+                                         ncc::PRIORITY_BULK);
+  while (pool.get_stats().queue_depth){
+    sched_yield();
+  }
+  ncc::CompileFuture dropped = pool.submit("int dropped(){ return 2; }",
+                                           "dropped", ncc::PRIORITY_BULK);
+  ncc::CompileFuture broken = pool.submit("int broken({", "",
+                                          ncc::PRIORITY_BULK);
+  /* only compiles once urgent() exists */
+  ncc::CompileFuture normal = pool.submit("int normal(){ return urgent() + 1; }",
+                                          "normal", ncc::PRIORITY_NORMAL);
+  ncc::CompileFuture urgent = pool.submit("int urgent(){ return 3; }",
+                                          "urgent",
+                                          ncc::PRIORITY_INTERACTIVE);
+  check(pool.get_stats().queue_depth == 4, "queue depth");
+  check(dropped.cancel(), "cancelling a queued request");
+  check(!first.cancel(), "cancelling a running request");
+  check(!first.is_ready(), "waiting for a running request");
+  delete hold;
+
+  check(call(urgent.get()) == 3, "interactive request");
+  check(call(normal.get()) == 4, "normal request after interactive");
+  check(first.get() == NULL && first.is_ready(), "request without function");
+  check(fails(dropped), "cancelled request");
+  check(fails(broken), "request with a parse error");
+
+  ncc::AsyncCompileStats s = pool.get_stats();
+  check(s.submitted == 5 && s.completed == 3 && s.failed == 1
+        && s.cancelled == 1, "request counts");
+  check(s.queue_depth == 0 && s.max_queue_depth == 4, "queue statistics");
+  check(s.max_wait > 0 && s.max_compile > 0, "latency statistics");
+  if (failures){
+    pool.print_stats(std::cerr);
+  }
+  return failures != 0;
+}
@@ -0,0 +1,204 @@
+#include "cache.hxx"
+#include "exceptions.hxx"
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+
+using namespace ncc;
+
+CodeCache::CodeCache(const std::string& directory, 
+                     unsigned long max_size) : directory(directory),
+                                               max_size(max_size),
+                                               hits(0),
+                                               misses(0),
+                                               stores(0),
+                                               evictions(0){
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST){
+    throw new CacheError("cannot create " + directory);
+  }
+}
+
+/* 64 bit FNV-1a */
+std::string CodeCache::hash(const std::string& data){
+  unsigned long long h = 14695981039346656037ULL;
+  char buf[17];
+
+  for (std::string::const_iterator i = data.begin(); i != data.end(); i++){
+    h ^= (unsigned char)*i;
+    h *= 1099511628211ULL;
+  }
+  snprintf(buf, sizeof(buf), "%016llx", h);
+  return buf;
+}
+
+std::string CodeCache::get_path(const std::string& key){
+  return directory + "/" + key + ".bc";
+}
+
+/* what goes before the bitcode, padded to the words the reader wants */
+static std::string entry_header(const std::string& material){
+  std::ostringstream s;
+  s << "ncc-cache " << material.size() << "\n" << material;
+  std::string header = s.str();
+  header.append((4 - header.size() % 4) % 4, '\n');
+  return header;
+}
+
+llvm::Module* CodeCache::load(const std::string& material){
+  std::string path = get_path(hash(material));
+  std::string error;
+  llvm::MemoryBuffer* buffer = llvm::MemoryBuffer::getFile(path.c_str(),
+                                                           path.size(),
+                                                           &error);
+  if (!buffer){
+    misses++;
+    return NULL;
+  }
+  std::string header = entry_header(material);
+  if (buffer->getBufferSize() < header.size()
+      || memcmp(buffer->getBufferStart(), header.data(), header.size())){
+    /* another text with the same hash, the next store replaces it */
+    delete buffer;
+    misses++;
+    return NULL;
+  }
+  llvm::MemoryBuffer* bitcode = 
+    llvm::MemoryBuffer::getMemBuffer(buffer->getBufferStart() + header.size(),
+                                     buffer->getBufferEnd());
+  llvm::Module* module = llvm::ParseBitcodeFile(bitcode, &error);
+  delete bitcode;
+  delete buffer;
+  if (!module){
+    /* truncated or from an incompatible build */
+    unlink(path.c_str());
+    misses++;
+    return NULL;
+  }
+
+  /* the modification time orders entries for eviction */
+  utime(path.c_str(), NULL);
+  hits++;
+  return module;
+}
+
+void CodeCache::store(const std::string& material, llvm::Module* module){
+  std::string path = get_path(hash(material));
+  std::ostringstream tmp;
+  tmp << path << ".tmp." << getpid();
+
+  std::ofstream os(tmp.str().c_str(), std::ios::out | std::ios::binary);
+  if (os){
+    os << entry_header(material);
+    llvm::WriteBitcodeToFile(module, os);
+    os.close();
+  }
+  if (!os || rename(tmp.str().c_str(), path.c_str()) != 0){
+    unlink(tmp.str().c_str());
+    throw new CacheError("cannot write " + path);
+  }
+  stores++;
+  trim();
+}
+
+struct CacheEntry {
+  std::string path;
+  time_t mtime;
+  unsigned long size;
+
+  bool operator<(const CacheEntry& other) const {
+    return mtime < other.mtime;
+  }
+};
+
+void CodeCache::trim(){
+  std::vector<CacheEntry> entries;
+  unsigned long total = 0;
+  DIR* dir = opendir(directory.c_str());
+  struct dirent* d;
+
+  if (!dir){
+    return;
+  }
+  while ((d = readdir(dir))){
+    std::string name = d->d_name;
+    struct stat st;
+    if (name.size() < 3 || name.substr(name.size() - 3) != ".bc"){
+      continue;
+    }
+    CacheEntry e;
+    e.path = directory + "/" + name;
+    if (stat(e.path.c_str(), &st) != 0){
+      continue;
+    }
+    e.mtime = st.st_mtime;
+    e.size = st.st_size;
+    total += e.size;
+    entries.push_back(e);
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end());
+  for (std::vector<CacheEntry>::iterator i = entries.begin();
+       i != entries.end() && total > max_size; i++){
+    if (unlink(i->path.c_str()) == 0){
+      total -= i->size;
+      evictions++;
+    }
+  }
+}
+
+/* 
+ * Adds the counters of this process to the totals kept in the cache
+ * directory. Concurrent runs may lose an update, never the file.
+ */
+void CodeCache::save_stats(){
+  std::string path = directory + "/stats";
+  std::ifstream is(path.c_str());
+  std::string name;
+  unsigned long value;
+
+  while (is >> name >> value){
+    if (name == "hits"){
+      hits += value;
+    } else if (name == "misses"){
+      misses += value;
+    } else if (name == "stores"){
+      stores += value;
+    } else if (name == "evictions"){
+      evictions += value;
+    }
+  }
+  is.close();
+
+  std::ostringstream tmp;
+  tmp << path << ".tmp." << getpid();
+  std::ofstream os(tmp.str().c_str());
+  os << "hits " << hits << std::endl
+     << "misses " << misses << std::endl
+     << "stores " << stores << std::endl
+     << "evictions " << evictions << std::endl;
+  os.close();
+  if (!os || rename(tmp.str().c_str(), path.c_str()) != 0){
+    unlink(tmp.str().c_str());
+    throw new CacheError("cannot write " + path);
+  }
+}
+
+void CodeCache::print_stats(std::ostream& os){
+  os << "Code cache " << directory << ": " 
+     << hits << " hits, " << misses << " misses, "
+     << stores << " stores, " << evictions << " evictions" << std::endl;
+}
@@ -0,0 +1,41 @@
+#ifndef HXX__ncc__cache__
+#define HXX__ncc__cache__
+
+#include "llvm/Module.h"
+
+#include <string>
+#include <ostream>
+
+namespace ncc {
+  /*
+   * Directory of compiled modules as bitcode, named by a hash of
+   * everything that went into them. Each entry starts with that text
+   * itself, so that a load with a different text of the same hash
+   * misses. Entries are written atomically and the least recently used
+   * ones are removed once the directory grows past max_size bytes.
+   */
+  class CodeCache {
+  protected:
+    std::string directory;
+    unsigned long max_size;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+
+    std::string get_path(const std::string& key);
+    void trim();
+  public:
+    CodeCache(const std::string& directory, unsigned long max_size);
+
+    static std::string hash(const std::string& data);
+
+    llvm::Module* load(const std::string& material);
+    void store(const std::string& material, llvm::Module* module);
+
+    void save_stats();
+    void print_stats(std::ostream& os);
+  };
+}
+
+#endif
@@ -53,7 +53,25 @@ void CommandOptions::process_option
       throw CommandOptions_error("'--' specified without option name");
     
     std::string name = s.substr(2);
-    
+
+    // split "--name=value" into option name and inline argument
+    std::string::size_type eq = name.find('=');
+    if (eq != std::string::npos) {
+      std::string value = name.substr(eq + 1);
+      name = name.substr(0, eq);
+
+      for (option_iterator it = option_table.begin(); it != option_table.end(); ++it)
+	if (it->long_name == name) {
+	  if (!it->par->update(value))
+	    throw CommandOptions_error("invalid argument '" + value +
+				       "' for option '--" + name + "'");
+	  return;
+	}
+
+      throw CommandOptions_error("unrecognized option '--" + name +
+				 "' (or option does not take an argument)");
+    }
+
     // catch the built-in options
     if (name == "help")
       print_help(hPrefix);
@@ -0,0 +1,1842 @@
+#include "compiler.hxx"
+#include "token.hxx"
+#include "parse.hxx"
+#include "AST.hxx"
+#include "exceptions.hxx"
+#include "target.hxx"
+#include "optimize.hxx"
+#include "analysis.hxx"
+#include "specialize.hxx"
+#include "lock.hxx"
+#include "queue.hxx"
+#include "split.hxx"
+
+#include "llvm/Linker.h"
+#include "llvm/CallingConv.h"
+#include "llvm/Instructions.h"
+#include "llvm/ModuleProvider.h"
+
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#ifndef NCC_VERSION
+#define NCC_VERSION "unknown"
+#endif
+
+using namespace ncc;
+
+/*
+ * The JIT of LLVM 2.2 keeps its state in globals, there can only be one
+ * per process. Sessions add their modules to it and take them out
+ * again. Its own empty module stays first: the JIT runs its code
+ * generator through the provider it was created with.
+ */
+static llvm::ExecutionEngine* process_engine = NULL;
+static std::set<Compiler*> engine_sessions;
+
+Compiler::Compiler(const CodegenOptions& options) : ee(NULL),
+                                                    provider(NULL),
+                                                    cpu("native"),
+                                                    compiled(false),
+                                                    optimized(false),
+                                                    lazy(true),
+                                                    parse_jobs(1),
+                                                    pretokenize(false),
+                                                    streaming(false),
+                                                    cache(NULL),
+                                                    ast_dump(NULL),
+                                                    log(NULL),
+                                                    replacements(0),
+                                                    auto_trim(true),
+                                                    tree_bytes(0),
+                                                    evictions(0),
+                                                    reloads(0),
+                                                    fatal_error(NULL){
+  LLVMLock lock;
+  functions = new FunctionTable(options);
+  global_symbols = new SymbolTable(functions);
+  module = new llvm::Module("");
+}
+
+Compiler::~Compiler(){
+  LLVMLock lock;
+  delete_units();
+  if (ee){
+    release_engine();
+  }
+  delete module;
+  delete global_symbols;
+  delete functions;
+}
+
+void Compiler::compile(std::istream& is){
+  Tokenizer t(is);
+  if (auto_trim){
+    trim_code();
+  }
+  cache_material.clear();
+  generate(t);
+}
+
+/* parser thread of Compiler::generate */
+struct ParseStage {
+  Tokenizer* tokenizer;
+  Parser* parser;
+  std::ostream* ast_dump;
+  BoundedQueue<TopLevelForm*, 64> forms;
+  ParseError* error;
+  volatile int cancelled;
+};
+
+/* pushes every form and then NULL, also after errors or cancellation */
+static void* parse_worker(void* arg){
+  ParseStage* stage = (ParseStage*)arg;
+  TopLevelForm* f;
+
+  do {
+    f = NULL;
+    if (!stage->cancelled){
+      try {
+        f = stage->parser->read_toplevel();
+      } catch (std::exception* e){
+        stage->error = new ParseError(stage->tokenizer->get_line(), 
+                                      stage->tokenizer->get_column(), 
+                                      e->what());
+      } catch (...){
+        stage->error = new ParseError(stage->tokenizer->get_line(), 
+                                      stage->tokenizer->get_column(), 
+                                      "unexpected exception");
+      }
+    }
+    if (f && stage->ast_dump){
+      f->print(*stage->ast_dump, 0);
+    }
+    stage->forms.push(f);
+  } while (f);
+  return NULL;
+}
+
+/*
+ * The parser runs one thread ahead and hands forms over through a
+ * bounded queue while this thread generates code for them, so reading
+ * large inputs overlaps with code generation.
+ */
+void Compiler::generate(Tokenizer& t){
+  if (optimized){
+    throw new FeatureNotImplemented("adding code after whole program "
+                                    "optimization");
+  }
+
+  if (streaming){
+    generate_streaming(t);
+    return;
+  }
+
+  Parser p(t);
+  TopLevelForm* f;
+  ParseStage stage;
+  pthread_t parser_thread;
+
+  stage.tokenizer = &t;
+  stage.parser = &p;
+  stage.ast_dump = ast_dump;
+  stage.error = NULL;
+  stage.cancelled = 0;
+  if (pthread_create(&parser_thread, NULL, parse_worker, &stage) != 0){
+    throw new CompileError("cannot start parser thread");
+  }
+
+  try {
+    while ((f = stage.forms.pop())){
+      /* other sessions may generate code between our forms */
+      LLVMLock lock;
+      try {
+        f->generate(module, global_symbols);
+      } catch (std::exception* e){
+        delete f;
+        throw;
+      }
+      if (!keep_unit(f)){
+        delete f;
+      }
+    }
+  } catch (std::exception* e){
+    stage.cancelled = 1;
+    while ((f = stage.forms.pop())){
+      delete f;
+    }
+    pthread_join(parser_thread, NULL);
+    throw;
+  }
+  pthread_join(parser_thread, NULL);
+  if (stage.error){
+    throw stage.error;
+  }
+
+  LLVMLock lock;
+  compiled = true;
+  infer_function_attributes(functions);
+}
+
+/*
+ * Code is generated by the parser itself, so forms have to be read and
+ * generated in turn, all under the lock. Errors from either are
+ * reported at the current position.
+ */
+void Compiler::generate_streaming(Tokenizer& t){
+  /* bodies are gone before they could be compared */
+  if (functions->get_options().dedup){
+    throw new FeatureNotImplemented("deduplicating streamed functions");
+  }
+  Parser p(t);
+  TopLevelForm* f;
+
+  p.set_streaming(module, global_symbols);
+  for (;;){
+    /* other sessions may generate code between our forms */
+    LLVMLock lock;
+    try {
+      f = p.read_toplevel();
+    } catch (std::exception* e){
+      throw new ParseError(t.get_line(), t.get_column(), e->what());
+    }
+    if (!f){
+      break;
+    }
+    if (ast_dump){
+      f->print(*ast_dump, 0);
+    }
+    try {
+      f->generate(module, global_symbols);
+    } catch (std::exception* e){
+      delete f;
+      throw;
+    }
+    delete f;
+  }
+
+  LLVMLock lock;
+  compiled = true;
+  infer_function_attributes(functions);
+}
+
+/* thread of Compiler::generate_parallel, parses one chunk */
+struct ChunkParse {
+  const char* source;
+  SourceChunk chunk;
+  bool pretokenize;
+  std::vector<TopLevelForm*> forms;
+  ParseError* error;
+};
+
+static void parse_forms(Tokenizer& t, ChunkParse* c){
+  try {
+    Parser p(t);
+    TopLevelForm* f;
+    while ((f = p.read_toplevel())){
+      c->forms.push_back(f);
+    }
+  } catch (std::exception* e){
+    c->error = new ParseError(t.get_line(), t.get_column(), e->what());
+  } catch (...){
+    c->error = new ParseError(t.get_line(), t.get_column(), 
+                              "unexpected exception");
+  }
+}
+
+static void* parse_chunk(void* arg){
+  ChunkParse* c = (ChunkParse*)arg;
+  const char* begin = c->source + c->chunk.begin;
+  size_t length = c->chunk.end - c->chunk.begin;
+
+  if (c->pretokenize){
+    TokenArray tokens(begin, length, c->chunk.line, c->chunk.column);
+    Tokenizer t(tokens);
+    parse_forms(t, c);
+  } else {
+    std::istringstream is(std::string(begin, length));
+    Tokenizer t(is, c->chunk.line, c->chunk.column);
+    parse_forms(t, c);
+  }
+  return NULL;
+}
+
+/*
+ * Parses the chunks of a large source on their own threads, then
+ * generates the forms in source order. As with a single parser, the
+ * forms before the first parse error are generated before it is raised.
+ */
+void Compiler::generate_parallel(const char* source, 
+                                 const std::vector<SourceChunk>& chunks){
+  if (optimized){
+    throw new FeatureNotImplemented("adding code after whole program "
+                                    "optimization");
+  }
+
+  std::vector<ChunkParse> parses(chunks.size());
+  std::vector<pthread_t> threads(chunks.size());
+  std::vector<bool> started(chunks.size(), false);
+
+  for (size_t i = 0; i < chunks.size(); i++){
+    parses[i].source = source;
+    parses[i].chunk = chunks[i];
+    parses[i].pretokenize = pretokenize;
+    parses[i].error = NULL;
+    started[i] = (pthread_create(&threads[i], NULL, parse_chunk, 
+                                 &parses[i]) == 0);
+  }
+  for (size_t i = 0; i < chunks.size(); i++){
+    if (started[i]){
+      pthread_join(threads[i], NULL);
+    } else {
+      parse_chunk(&parses[i]);
+    }
+  }
+
+  std::exception* error = NULL;
+  for (size_t i = 0; i < parses.size(); i++){
+    for (std::vector<TopLevelForm*>::iterator f = parses[i].forms.begin();
+         f != parses[i].forms.end(); f++){
+      if (!error){
+        if (ast_dump){
+          (*f)->print(*ast_dump, 0);
+        }
+        try {
+          LLVMLock lock;
+          (*f)->generate(module, global_symbols);
+          if (keep_unit(*f)){
+            continue;
+          }
+        } catch (std::exception* e){
+          error = e;
+        }
+      }
+      delete *f;
+    }
+    if (!error && parses[i].error){
+      error = parses[i].error;
+    }
+  }
+  if (error){
+    throw error;
+  }
+
+  LLVMLock lock;
+  compiled = true;
+  infer_function_attributes(functions);
+}
+
+void Compiler::compile(const char* source, size_t length){
+  std::string material;
+
+  if (auto_trim){
+    trim_code();
+  }
+  if (cache && !compiled && !ee){
+    material = get_configuration() + std::string(source, length);
+    if (load_cached(material)){
+      return;
+    }
+  }
+
+  /* chunks smaller than this are not worth a thread */
+  const size_t min_chunk = 256 * 1024;
+  unsigned int n = streaming ? 1 : parse_jobs;
+  if (n > length / min_chunk){
+    n = length / min_chunk;
+  }
+  std::vector<SourceChunk> chunks;
+  if (n > 1){
+    chunks = split_toplevel(source, length, n);
+  }
+
+  if (chunks.size() > 1){
+    cache_material.clear();
+    generate_parallel(source, chunks);
+  } else if (pretokenize){
+    TokenArray tokens(source, length);
+    Tokenizer t(tokens);
+    generate(t);
+  } else {
+    std::istringstream is(std::string(source, length));
+    Tokenizer t(is);
+    generate(t);
+  }
+  cache_material = material;
+}
+
+/* everything besides the source that changes the generated code */
+std::string Compiler::get_configuration(){
+  const CodegenOptions& options = functions->get_options();
+  std::ostringstream s;
+
+  s << "ncc " << NCC_VERSION 
+    << " fp_model " << options.fp_model
+    << " whole_program " << options.whole_program
+    << " cpu " << cpu << " attrs " << attrs;
+  if (cpu == "native"){
+    std::vector<std::string> host = detect_host_features();
+    for (std::vector<std::string>::iterator i = host.begin();
+         i != host.end(); i++){
+      s << " " << *i;
+    }
+  }
+  s << " salt " << cache_salt << "\n";
+  return s.str();
+}
+
+static ValueType get_value_type(const llvm::Type* t){
+  if (t == llvm::Type::Int32Ty){
+    return TYPE_INTEGER;
+  } else if (t == llvm::Type::DoubleTy){
+    return TYPE_DOUBLE;
+  } else if (t == llvm::Type::VoidTy){
+    return TYPE_VOID;
+  }
+  return TYPE_POINTER;
+}
+
+/* generated names have a dot in them, those from the source do not */
+static bool is_source_name(const std::string& name){
+  return name.find('.') == std::string::npos;
+}
+
+/* the globals of the module that come from source, by their names */
+void Compiler::import_globals(){
+  for (llvm::Module::global_iterator i = module->global_begin();
+       i != module->global_end(); i++){
+    if (i->hasInitializer() && is_source_name(i->getName())){
+      const llvm::Type* t = i->getInitializer()->getType();
+      global_symbols->put_symbol(i->getName(), 
+                                 Variable(&*i, get_value_type(t)));
+    }
+  }
+}
+
+bool Compiler::load_cached(const std::string& material){
+  LLVMLock lock;
+  llvm::Module* m = cache->load(material);
+  if (!m){
+    if (log){
+      *log << "Code cache miss: " << CodeCache::hash(material) << std::endl;
+    }
+    return false;
+  }
+  if (log){
+    *log << "Code cache hit: " << CodeCache::hash(material) << std::endl;
+  }
+
+  delete module;
+  module = m;
+
+  /* 
+   * The symbol tables are all later sources and the host need from the
+   * front-end: the globals and what can be called from outside.
+   */
+  import_globals();
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    if (i->isDeclaration() || i->hasInternalLinkage() 
+        || i->getCallingConv() != llvm::CallingConv::C
+        || !is_source_name(i->getName())){
+      continue;
+    }
+    const llvm::FunctionType* t = i->getFunctionType();
+    std::vector<ValueType> arg_types;
+    for (unsigned int n = 0; n < t->getNumParams(); n++){
+      arg_types.push_back(get_value_type(t->getParamType(n)));
+    }
+    Function entry(get_value_type(t->getReturnType()), arg_types, &*i);
+    entry.set_defined();
+    entry.set_exported();
+    entry.set_cell(module->getGlobalVariable(i->getName() + ".cell", true));
+    functions->put_function(i->getName(), entry);
+  }
+
+  compiled = true;
+  optimized = functions->get_options().whole_program;
+  return true;
+}
+
+void Compiler::optimize(){
+  /* internalized cells would be folded into direct calls */
+  if (optimized || !functions->get_options().whole_program
+      || functions->get_options().uses_cells()){
+    return;
+  }
+  LLVMLock lock;
+  std::vector<std::string> exports;
+  for (FunctionTable::iterator i = functions->begin(); 
+       i != functions->end(); i++){
+    if (i->second.is_exported()){
+      exports.push_back(i->first);
+    }
+  }
+  /* 
+   * Only the profile reads the counters and only the emitter the clone
+   * lists, they would be optimized away.
+   */
+  for (llvm::Module::global_iterator i = module->global_begin();
+       i != module->global_end(); i++){
+    if (i->getName().compare(0, 9, "ncc.prof.") == 0
+        || i->getName().compare(0, 11, "ncc.clones.") == 0){
+      exports.push_back(i->getName());
+    }
+  }
+
+  int before = count_functions(module);
+  optimize_whole_program(module, exports);
+  optimized = true;
+  if (log){
+    *log << "Whole program optimization: " << before 
+         << " functions before, " << count_functions(module) 
+         << " after" << std::endl;
+  }
+}
+
+llvm::ExecutionEngine* Compiler::get_engine(){
+  LLVMLock lock;
+  if (ee){
+    return ee;
+  }
+
+  optimize();
+
+  if (cache && !cache_material.empty()){
+    try {
+      cache->store(cache_material, module);
+    } catch (CacheError* e){
+      if (log){
+        *log << "Warning: " << e->what() << std::endl;
+      }
+    }
+    cache_material.clear();
+  }
+
+  std::string features = select_jit_target(cpu, attrs);
+  if (log){
+    std::vector<std::string> host = detect_host_features();
+    *log << "Host CPU features:";
+    for (std::vector<std::string>::iterator i = host.begin();
+         i != host.end(); i++){
+      *log << " " << *i;
+    }
+    *log << std::endl;
+    *log << "Target CPU: " << cpu << std::endl;
+    *log << "Target features: " << features << std::endl;
+  }
+
+  if (!process_engine){
+    llvm::Module* base = new llvm::Module("ncc");
+    process_engine = llvm::ExecutionEngine::create(
+      new llvm::ExistingModuleProvider(base));
+  }
+  provider = new llvm::ExistingModuleProvider(module);
+  process_engine->addModuleProvider(provider);
+  ee = process_engine;
+  if (!engine_sessions.empty()){
+    /* other threads may run the code of other sessions */
+    lazy = false;
+    for (std::set<Compiler*>::iterator i = engine_sessions.begin();
+         i != engine_sessions.end(); i++){
+      if ((*i)->lazy){
+        (*i)->lazy = false;
+        (*i)->compile_pending();
+      }
+    }
+  }
+  engine_sessions.insert(this);
+
+  llvm::Function* value_profile = module->getFunction("ncc_value_profile");
+  if (value_profile){
+    ee->addGlobalMapping(value_profile, (void*)ncc_value_profile);
+  }
+  if (functions->get_options().specializer){
+    Specializer* specializer = functions->get_options().specializer;
+    llvm::GlobalVariable* self = module->getGlobalVariable("ncc.specializer");
+    if (self){
+      ee->addGlobalMapping(self, specializer);
+    }
+    specializer->set_engine(ee);
+  }
+  /* stubs would compile from running code while replace() works */
+  if (!lazy || functions->get_options().hot_swap){
+    compile_pending();
+  }
+  return ee;
+}
+
+/* callees first, so that calls go straight to their code */
+static void compile_with_callees(llvm::ExecutionEngine* ee, 
+                                 llvm::Function* f,
+                                 std::set<llvm::Function*>& visited){
+  if (f->isDeclaration() || !visited.insert(f).second){
+    return;
+  }
+  for (llvm::Function::iterator b = f->begin(); b != f->end(); b++){
+    for (llvm::BasicBlock::iterator i = b->begin(); i != b->end(); i++){
+      llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&*i);
+      if (call && call->getCalledFunction()){
+        compile_with_callees(ee, call->getCalledFunction(), visited);
+      }
+    }
+  }
+  if (!ee->getPointerToGlobalIfAvailable(f)){
+    ee->getPointerToFunction(f);
+  }
+}
+
+/* 
+ * Compiles what has no machine code yet, so that running code never
+ * reaches a lazy stub. Stubs compile without the session lock. Only
+ * calls within a cycle still go through a stub, its first call finds
+ * the code compiled already.
+ */
+void Compiler::compile_pending(){
+  LLVMLock lock;
+  std::set<llvm::Function*> visited;
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    compile_with_callees(ee, &*i, visited);
+  }
+}
+
+/* 
+ * Takes the module out of the process JIT again, with its code and the
+ * addresses the JIT knows for it. The last session deletes the JIT.
+ */
+void Compiler::release_engine(){
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    if (!i->isDeclaration() && ee->getPointerToGlobalIfAvailable(&*i)){
+      ee->freeMachineCodeForFunction(&*i);
+    } else {
+      ee->updateGlobalMapping(&*i, NULL);
+    }
+  }
+  for (llvm::Module::global_iterator i = module->global_begin(); 
+       i != module->global_end(); i++){
+    ee->updateGlobalMapping(&*i, NULL);
+  }
+  ee->removeModuleProvider(provider);
+  delete provider;
+  provider = NULL;
+  ee = NULL;
+  engine_sessions.erase(this);
+  if (engine_sessions.empty()){
+    delete process_engine;
+    process_engine = NULL;
+  }
+}
+
+/* functions the JIT has emitted machine code for so far */
+int Compiler::count_compiled_functions(){
+  int n = 0;
+  if (!ee){
+    return 0;
+  }
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    if (!i->isDeclaration() && ee->getPointerToGlobalIfAvailable(&*i)){
+      n++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Whether the host can call f through a C function pointer of the type
+ * in the table. Internal functions use the fast calling convention and
+ * may have lost arguments to whole program optimization.
+ */
+static bool has_c_signature(llvm::Function* f, Function& entry){
+  const llvm::FunctionType* t = f->getFunctionType();
+  if (f->getCallingConv() != llvm::CallingConv::C
+      || get_value_type(t->getReturnType()) != entry.get_ret_type()
+      || (int)t->getNumParams() != entry.get_arg_count()){
+    return false;
+  }
+  for (unsigned int i = 0; i < t->getNumParams(); i++){
+    if (get_value_type(t->getParamType(i)) != entry.get_arg_type(i)){
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * What the host calls. With hot swapping that is an entry that calls
+ * through the cell, so pointers handed out follow replacements and
+ * never point at code that gets freed. A function sharing the body of
+ * another one hands out the shared code.
+ */
+llvm::Function* Compiler::get_entry(const std::string& name){
+  Function* entry = functions->find_function(name);
+  llvm::Function* f = module->getFunction(name);
+
+  if (!entry || !entry->is_defined() || !f){
+    throw new UnknownSymbol(name);
+  }
+  if (!entry->get_cell()){
+    /* whole program optimization may have replaced the function */
+    llvm::Function* code = optimized ? f : entry->get_address();
+    if (!has_c_signature(code, *entry)){
+      throw new InvalidArgument(name + " is internal to the program, "
+                                "only exported functions can be called");
+    }
+    return code;
+  }
+
+  LLVMLock lock;
+  llvm::Function* e = module->getFunction(name + ".entry");
+  if (e){
+    return e;
+  }
+  e = new llvm::Function(f->getFunctionType(), 
+                         llvm::GlobalValue::ExternalLinkage,
+                         name + ".entry",
+                         module);
+  llvm::LLVMBuilder builder(new llvm::BasicBlock("entry", e));
+  std::vector<llvm::Value*> a;
+  for (llvm::Function::arg_iterator i = e->arg_begin(); 
+       i != e->arg_end(); i++){
+    a.push_back(i);
+  }
+  llvm::Value* target = builder.CreateLoad(entry->get_cell(), "target");
+  llvm::CallInst* call = builder.CreateCall(target, a.begin(), a.end(), 
+                                            "rv");
+  call->setCallingConv(f->getCallingConv());
+  call->setTailCall();
+  builder.CreateRet(call);
+  return e;
+}
+
+void* Compiler::get_function_pointer(const std::string& name){
+  llvm::Function* f = get_entry(name);
+  LLVMLock lock;
+  get_engine();
+  if (!lazy || functions->get_options().hot_swap){
+    /* functions added since the engine was created */
+    compile_pending();
+  }
+  return ee->getPointerToFunction(f);
+}
+
+int Compiler::run_main(const std::vector<std::string>& args,
+                       const char* const* envp){
+  if (!module->getFunction("main")){
+    throw new UnknownSymbol("main");
+  }
+  llvm::Function* mf = get_entry("main");
+  {
+    /* compile it here, running it needs no lock */
+    LLVMLock lock;
+    get_engine();
+    if (!lazy || functions->get_options().hot_swap){
+      compile_pending();
+    }
+    ee->getPointerToFunction(mf);
+  }
+  int rv = ee->runFunctionAsMain(mf, args, envp);
+  if (auto_trim){
+    trim_code();
+  }
+  return rv;
+}
+
+/* output of a forked main beyond this is dropped */
+static const size_t max_output = 16 << 20;
+
+/* reads fd to the end, keeping up to max_output bytes */
+static void read_output(int fd, std::string& output){
+  char buffer[4096];
+  ssize_t n;
+  bool truncated = false;
+
+  output.clear();
+  for (;;){
+    n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      break;
+    }
+    if (output.size() + n <= max_output){
+      output.append(buffer, n);
+    } else {
+      truncated = true;
+    }
+  }
+  if (truncated){
+    output += "\n[output truncated]\n";
+  }
+}
+
+std::string Compiler::run_main_forked(const std::vector<std::string>& args,
+                                      const char* const* envp,
+                                      std::string* output){
+  if (!module->getFunction("main")){
+    throw new UnknownSymbol("main");
+  }
+  llvm::Function* mf = get_entry("main");
+  int fds[2];
+  int output_fds[2];
+  pid_t child;
+  {
+    /* 
+     * All code is compiled first. No other thread is inside LLVM while
+     * the lock is held, so the child finds LLVM in a usable state.
+     */
+    LLVMLock lock;
+    get_engine();
+    compile_pending();
+    ee->getPointerToFunction(mf);
+    if (pipe(fds) != 0){
+      throw new CompileError("cannot create a pipe for main");
+    }
+    if (output && pipe(output_fds) != 0){
+      close(fds[0]);
+      close(fds[1]);
+      throw new CompileError("cannot create a pipe for main");
+    }
+    fflush(NULL);
+    child = fork();
+    if (child == 0){
+      LLVMLock::forked();
+      close(fds[0]);
+      if (output){
+        int input = open("/dev/null", O_RDONLY);
+        if (input < 0 || dup2(input, 0) < 0 || dup2(output_fds[1], 1) < 0 
+            || dup2(output_fds[1], 2) < 0){
+          _exit(1);
+        }
+        close(input);
+        close(output_fds[0]);
+        close(output_fds[1]);
+      }
+      int rv = ee->runFunctionAsMain(mf, args, envp);
+      ssize_t written = write(fds[1], &rv, sizeof(rv));
+      fflush(NULL);
+      _exit(written == sizeof(rv) ? 0 : 1);
+    }
+  }
+  close(fds[1]);
+  if (output){
+    close(output_fds[1]);
+  }
+  if (child < 0){
+    close(fds[0]);
+    if (output){
+      close(output_fds[0]);
+    }
+    throw new CompileError("cannot fork a process for main");
+  }
+
+  /* a child blocked on a full pipe would never write its result */
+  if (output){
+    read_output(output_fds[0], *output);
+    close(output_fds[0]);
+  }
+  int rv;
+  ssize_t n;
+  do {
+    n = read(fds[0], &rv, sizeof(rv));
+  } while (n < 0 && errno == EINTR);
+  close(fds[0]);
+  int status;
+  while (waitpid(child, &status, 0) < 0 && errno == EINTR){
+  }
+
+  std::ostringstream out;
+  if (n == sizeof(rv)){
+    out << "main() returned: " << rv;
+  } else if (WIFEXITED(status)){
+    out << "main() exited with status " << WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)){
+    out << "main() was killed by signal " << WTERMSIG(status);
+  } else {
+    out << "main() ended abnormally";
+  }
+  return out.str();
+}
+
+/* calls to a builtin in users must not end up in a body of defining */
+static void check_builtins(FunctionTable* users, FunctionTable* defining){
+  for (std::set<std::string>::const_iterator i = 
+         users->get_builtins().begin();
+       i != users->get_builtins().end(); i++){
+    Function* f = defining->find_function(*i);
+    if (f && f->is_defined()){
+      throw new LinkError("builtin " + *i + " is defined in another file");
+    }
+  }
+}
+
+/* 
+ * Moves the code of other into this session. Both must not have an
+ * engine yet; other is left empty of use and should be deleted.
+ */
+void Compiler::link(Compiler* other){
+  LLVMLock lock;
+  std::string error;
+
+  if (ee || other->ee){
+    throw new FeatureNotImplemented("linking after code has been run");
+  }
+  check_builtins(functions, other->functions);
+  check_builtins(other->functions, functions);
+  if (llvm::Linker::LinkModules(module, other->module, &error)){
+    throw new LinkError(error);
+  }
+  for (std::set<std::string>::const_iterator i = 
+         other->functions->get_builtins().begin();
+       i != other->functions->get_builtins().end(); i++){
+    functions->note_builtin(*i);
+  }
+
+  for (FunctionTable::iterator i = other->functions->begin();
+       i != other->functions->end(); i++){
+    Function* mine = functions->find_function(i->first);
+    if (mine && (mine->is_defined() || !i->second.is_defined())){
+      continue;
+    }
+    Function entry = i->second;
+    entry.set_address(module->getFunction(i->first));
+    functions->put_function(i->first, entry);
+  }
+  import_globals();
+  compiled = true;
+  cache_material.clear();
+}
+
+struct FileJobs {
+  const std::vector<std::string>* files;
+  std::vector<Compiler*> sessions;
+  std::vector<std::string> errors;
+  CodegenOptions options;
+  std::string cpu;
+  std::string attrs;
+  std::ostream* ast_dump;
+  int next;
+};
+
+static void* compile_worker(void* arg){
+  FileJobs* jobs = (FileJobs*)arg;
+  int i;
+
+  while ((i = __sync_fetch_and_add(&jobs->next, 1)) 
+         < (int)jobs->files->size()){
+    const std::string& file = (*jobs->files)[i];
+    Compiler* session = new Compiler(jobs->options);
+    jobs->sessions[i] = session;
+    session->set_target(jobs->cpu, jobs->attrs);
+    session->set_ast_dump(jobs->ast_dump);
+
+    std::ifstream is(file.c_str());
+    if (!is){
+      jobs->errors[i] = "cannot open file";
+      continue;
+    }
+    std::string source((std::istreambuf_iterator<char>(is)),
+                       std::istreambuf_iterator<char>());
+    try {
+      session->compile(source);
+    } catch (ParseError* e){
+      jobs->errors[i] = std::string("parse error at ") + e->what();
+    } catch (std::exception* e){
+      jobs->errors[i] = e->what();
+    } catch (...){
+      jobs->errors[i] = "unexpected exception";
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Compiles every file in its own session on `jobs' threads and links
+ * the results into this session in the order given. Functions stay
+ * external until whole program optimization of the linked module, so
+ * files can call each other through prototypes.
+ */
+void Compiler::compile_files(const std::vector<std::string>& files, 
+                             int jobs){
+  FileJobs work;
+  std::vector<pthread_t> threads;
+
+  work.files = &files;
+  work.sessions.resize(files.size(), NULL);
+  work.errors.resize(files.size());
+  work.options = functions->get_options();
+  work.options.whole_program = false;
+  work.cpu = cpu;
+  work.attrs = attrs;
+  /* output of several threads would interleave */
+  work.ast_dump = (jobs == 1) ? ast_dump : NULL;
+  work.next = 0;
+
+  for (int i = 0; i < jobs && i < (int)files.size(); i++){
+    pthread_t t;
+    if (pthread_create(&t, NULL, compile_worker, &work) != 0){
+      break;
+    }
+    threads.push_back(t);
+  }
+  if (threads.empty()){
+    compile_worker(&work);
+  }
+  for (std::vector<pthread_t>::iterator i = threads.begin();
+       i != threads.end(); i++){
+    pthread_join(*i, NULL);
+  }
+
+  std::string error;
+  for (size_t i = 0; i < files.size(); i++){
+    if (error.empty() && !work.errors[i].empty()){
+      error = files[i] + ": " + work.errors[i];
+    }
+    if (error.empty()){
+      try {
+        link(work.sessions[i]);
+      } catch (LinkError* e){
+        error = files[i] + ": " + e->what();
+      }
+    }
+    delete work.sessions[i];
+  }
+  if (!error.empty()){
+    throw new CompileError(error);
+  }
+
+  LLVMLock lock;
+  infer_function_attributes(functions);
+}
+
+/* a top-level form of a source given to recompile() */
+struct ncc::SourceForm {
+  TopLevelForm* form;
+  std::string key;
+  std::string hash;
+};
+
+static std::string form_key(TopLevelForm* form){
+  FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(form);
+  FunctionDeclaration* p = dynamic_cast<FunctionDeclaration*>(form);
+  GlobalVariable* v = dynamic_cast<GlobalVariable*>(form);
+  if (d){
+    return "function " + d->get_name();
+  } else if (p){
+    return "prototype " + p->get_name();
+  } else if (v){
+    return "variable " + v->get_name();
+  }
+  return "";
+}
+
+/* whitespace and comments do not count as a change */
+static std::string token_hash(const TokenArray& tokens, 
+                              size_t begin, size_t end){
+  std::string text;
+  for (size_t i = begin; i < end; i++){
+    text += tokens.get_kind(i);
+    text.append(tokens.get_text(i), tokens.get_length(i));
+    text += '\0';
+  }
+  return CodeCache::hash(text);
+}
+
+static void delete_forms(const std::vector<SourceForm>& forms){
+  for (std::vector<SourceForm>::const_iterator i = forms.begin();
+       i != forms.end(); i++){
+    delete i->form;
+  }
+}
+
+/* parses everything before touching the session */
+static void read_forms(const TokenArray& tokens, 
+                       std::vector<SourceForm>& forms){
+  Tokenizer t(tokens);
+  try {
+    Parser p(t);
+    for (;;){
+      size_t begin = t.get_token_index();
+      TopLevelForm* f = p.read_toplevel();
+      if (!f){
+        break;
+      }
+      SourceForm sf;
+      sf.form = f;
+      sf.key = form_key(f);
+      sf.hash = token_hash(tokens, begin, t.get_token_index());
+      forms.push_back(sf);
+    }
+  } catch (std::exception* e){
+    delete_forms(forms);
+    forms.clear();
+    throw new ParseError(t.get_line(), t.get_column(), e->what());
+  }
+}
+
+/* what callers of f may assume about it */
+static int get_effect(llvm::Function* f){
+  return (f->doesNotAccessMemory() ? 1 : 0)
+    | (f->onlyReadsMemory() ? 2 : 0)
+    | (f->doesNotThrow() ? 4 : 0);
+}
+
+/* attribute inference only ever adds, so start over */
+static void reinfer_function_attributes(FunctionTable* functions){
+  for (FunctionTable::iterator i = functions->begin(); 
+       i != functions->end(); i++){
+    llvm::Function* f = i->second.get_address();
+    if (i->second.is_defined() && f){
+      f->setDoesNotAccessMemory(false);
+      f->setOnlyReadsMemory(false);
+      f->setDoesNotThrow(false);
+    }
+  }
+  infer_function_attributes(functions);
+}
+
+/* starts over with an empty module, keeping the settings */
+void Compiler::reset(){
+  CodegenOptions options = functions->get_options();
+  if (ee){
+    release_engine();
+  }
+  delete module;
+  delete global_symbols;
+  delete functions;
+  functions = new FunctionTable(options);
+  global_symbols = new SymbolTable(functions);
+  module = new llvm::Module("");
+  compiled = false;
+  optimized = false;
+  cache_material.clear();
+  form_hashes.clear();
+  live_versions.clear();
+  replaced.clear();
+  retired.clear();
+  delete_units();
+  evictions = 0;
+  reloads = 0;
+}
+
+/*
+ * A changed definition can replace its old body in place if its
+ * signature stays the same. Shared bodies may belong to other functions
+ * as well. With cells, calls may go to a replaced version or evicted
+ * code is generated again from its old tree.
+ */
+bool Compiler::can_regenerate(FunctionDefinition* d){
+  const CodegenOptions& options = functions->get_options();
+  if (options.dedup || options.uses_cells()){
+    return false;
+  }
+  /* callers of the builtin have to be generated again */
+  if (functions->uses_builtin(d->get_name())){
+    return false;
+  }
+  Function* entry = functions->find_function(d->get_name());
+  if (!entry){
+    return true;
+  }
+  return entry->get_ret_type() == d->get_type() 
+    && entry->get_arg_types() == d->get_arg_types();
+}
+
+/* calls in other functions keep pointing at the same llvm::Function */
+void Compiler::regenerate_function(FunctionDefinition* d){
+  llvm::Function* f = module->getFunction(d->get_name());
+  if (f && !f->isDeclaration()){
+    f->deleteBody();
+  }
+  d->generate(module, global_symbols);
+}
+
+/*
+ * Generates the changed definitions, then the unchanged functions whose
+ * own attributes or whose callees' attributes changed, since their code
+ * was generated assuming the old ones. Those attributes follow from the
+ * regenerated bodies alone, so one round of dependents is enough.
+ * Compiled code of every regenerated function is then replaced by the
+ * JIT, which patches the old code to jump to the new.
+ */
+int Compiler::regenerate(const std::vector<SourceForm>& forms,
+                         const std::set<std::string>& changed){
+  std::map<std::string, int> before;
+  std::set<std::string> generated;
+
+  for (FunctionTable::iterator i = functions->begin(); 
+       i != functions->end(); i++){
+    if (i->second.is_defined()){
+      before[i->first] = get_effect(i->second.get_address());
+    }
+  }
+
+  for (std::vector<SourceForm>::const_iterator i = forms.begin();
+       i != forms.end(); i++){
+    FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(i->form);
+    if (d && changed.count(d->get_name())){
+      regenerate_function(d);
+      generated.insert(d->get_name());
+    }
+  }
+  reinfer_function_attributes(functions);
+
+  std::set<std::string> affected;
+  for (std::map<std::string, int>::iterator i = before.begin();
+       i != before.end(); i++){
+    Function* entry = functions->find_function(i->first);
+    if (entry && get_effect(entry->get_address()) != i->second){
+      affected.insert(i->first);
+    }
+  }
+
+  std::set<std::string> dependents;
+  for (FunctionTable::iterator i = functions->begin(); 
+       i != functions->end(); i++){
+    if (!i->second.is_defined() || generated.count(i->first)){
+      continue;
+    }
+    const std::set<std::string>& callees = i->second.get_callees();
+    bool depends = affected.count(i->first) > 0;
+    for (std::set<std::string>::const_iterator j = callees.begin();
+         !depends && j != callees.end(); j++){
+      depends = affected.count(*j) > 0;
+    }
+    if (depends){
+      dependents.insert(i->first);
+    }
+  }
+
+  size_t direct = generated.size();
+  if (!dependents.empty()){
+    for (std::vector<SourceForm>::const_iterator i = forms.begin();
+         i != forms.end(); i++){
+      FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(i->form);
+      if (d && dependents.count(d->get_name())){
+        regenerate_function(d);
+        generated.insert(d->get_name());
+      }
+    }
+    reinfer_function_attributes(functions);
+  }
+
+  if (ee){
+    for (std::set<std::string>::iterator i = generated.begin();
+         i != generated.end(); i++){
+      llvm::Function* f = module->getFunction(*i);
+      /* the rest is still behind lazy compilation stubs */
+      if (ee->getPointerToGlobalIfAvailable(f)){
+        ee->recompileAndRelinkFunction(f);
+      }
+    }
+  }
+  if (log){
+    *log << "Regenerated " << generated.size() << " functions, "
+         << generated.size() - direct << " of them for changed callees" 
+         << std::endl;
+  }
+  return generated.size();
+}
+
+/*
+ * A rebuild starts the program with fresh globals, so an update in
+ * place must not leave it the values of the previous run either.
+ */
+void Compiler::reinitialize_globals(const std::map<std::string, 
+                                                   std::string>& forms){
+  const std::string kind = "variable ";
+  if (!ee){
+    return;
+  }
+  for (std::map<std::string, std::string>::const_iterator i = forms.begin();
+       i != forms.end(); i++){
+    if (i->first.compare(0, kind.size(), kind) != 0){
+      continue;
+    }
+    llvm::GlobalVariable* g = 
+      module->getGlobalVariable(i->first.substr(kind.size()), true);
+    void* address = g ? ee->getPointerToGlobalIfAvailable(g) : NULL;
+    if (address){
+      ee->InitializeMemory(g->getInitializer(), address);
+    }
+  }
+}
+
+int Compiler::recompile(const char* source, size_t length){
+  LLVMLock lock;
+  TokenArray tokens(source, length);
+  std::vector<SourceForm> forms;
+  std::map<std::string, std::string> hashes;
+  std::set<std::string> changed;
+  bool full = form_hashes.empty();
+  int n = 0;
+
+  if (optimized){
+    throw new FeatureNotImplemented("recompiling after whole program "
+                                    "optimization");
+  }
+
+  read_forms(tokens, forms);
+  for (std::vector<SourceForm>::iterator i = forms.begin();
+       i != forms.end(); i++){
+    hashes[i->key] += i->hash;
+  }
+
+  /* anything but changed or new definitions changes global state */
+  for (std::map<std::string, std::string>::iterator i = form_hashes.begin();
+       !full && i != form_hashes.end(); i++){
+    full = !hashes.count(i->first);
+  }
+  for (std::vector<SourceForm>::iterator i = forms.begin();
+       !full && i != forms.end(); i++){
+    std::map<std::string, std::string>::iterator old 
+      = form_hashes.find(i->key);
+    if (old != form_hashes.end() && old->second == hashes[i->key]){
+      continue;
+    }
+    FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(i->form);
+    if (!d || !can_regenerate(d)){
+      full = true;
+    } else {
+      changed.insert(d->get_name());
+    }
+  }
+
+  try {
+    if (full){
+      reset();
+      for (std::vector<SourceForm>::iterator i = forms.begin();
+           i != forms.end(); i++){
+        if (ast_dump){
+          i->form->print(*ast_dump, 0);
+        }
+        i->form->generate(module, global_symbols);
+        if (dynamic_cast<FunctionDefinition*>(i->form)){
+          n++;
+        }
+      }
+      compiled = true;
+      infer_function_attributes(functions);
+      if (log){
+        *log << "Generated all " << n << " functions" << std::endl;
+      }
+    } else {
+      n = regenerate(forms, changed);
+      reinitialize_globals(hashes);
+    }
+  } catch (std::exception* e){
+    /* whatever was generated, the next call starts over */
+    delete_forms(forms);
+    form_hashes.clear();
+    throw;
+  }
+  delete_forms(forms);
+  form_hashes = hashes;
+  return n;
+}
+
+/* calls in progress of a version from replace() */
+extern "C" void ncc_enter_version(int* active){
+  __sync_fetch_and_add(active, 1);
+}
+
+extern "C" void ncc_leave_version(int* active){
+  __sync_fetch_and_sub(active, 1);
+}
+
+static llvm::Function* version_hook(llvm::ExecutionEngine* ee,
+                                    llvm::Module* module, 
+                                    const char* name, void* address){
+  llvm::Function* f = module->getFunction(name);
+  if (!f){
+    std::vector<const llvm::Type*> arg_types;
+    arg_types.push_back(llvm::PointerType::getUnqual(llvm::Type::Int32Ty));
+    f = new llvm::Function(llvm::FunctionType::get(llvm::Type::VoidTy, 
+                                                   arg_types, false),
+                           llvm::GlobalValue::ExternalLinkage,
+                           name,
+                           module);
+    f->setDoesNotThrow();
+    ee->addGlobalMapping(f, address);
+  }
+  return f;
+}
+
+/* keeps the number of calls in f in the global NAME.active */
+static void count_active_calls(llvm::ExecutionEngine* ee, llvm::Function* f){
+  llvm::Module* module = f->getParent();
+  llvm::GlobalVariable* active = 
+    new llvm::GlobalVariable(llvm::Type::Int32Ty,
+                             false,
+                             llvm::GlobalValue::InternalLinkage,
+                             llvm::ConstantInt::get(llvm::Type::Int32Ty, 0),
+                             f->getName() + ".active",
+                             module);
+  llvm::Function* enter = version_hook(ee, module, "ncc_enter_version",
+                                       (void*)ncc_enter_version);
+  llvm::Function* leave = version_hook(ee, module, "ncc_leave_version",
+                                       (void*)ncc_leave_version);
+  std::vector<llvm::Instruction*> returns;
+
+  for (llvm::Function::iterator b = f->begin(); b != f->end(); b++){
+    if (llvm::isa<llvm::ReturnInst>(b->getTerminator())){
+      returns.push_back(b->getTerminator());
+    }
+  }
+  for (std::vector<llvm::Instruction*>::iterator i = returns.begin();
+       i != returns.end(); i++){
+    new llvm::CallInst(leave, active, "", *i);
+  }
+  llvm::BasicBlock& entry = f->getEntryBlock();
+  llvm::LLVMBuilder builder;
+  builder.SetInsertPoint(&entry, entry.begin());
+  builder.CreateCall(enter, active);
+}
+
+/*
+ * New versions are compiled while the current ones keep running, only
+ * the switch of the cell has to be atomic. The code a cell pointed to
+ * stays until free_replaced_code(), unless it is the original function,
+ * which is also the target of direct references and is never freed.
+ */
+void Compiler::replace(const char* source, size_t length){
+  if (!functions->get_options().hot_swap){
+    throw new FeatureNotImplemented("replacing functions without "
+                                    "hot swapping");
+  }
+
+  std::istringstream is(std::string(source, length));
+  Tokenizer t(is);
+  std::vector<FunctionDefinition*> definitions;
+  try {
+    Parser p(t);
+    TopLevelForm* f;
+    while ((f = p.read_toplevel())){
+      FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(f);
+      if (!d){
+        delete f;
+        throw new InvalidArgument("only function definitions can be "
+                                  "replaced");
+      }
+      definitions.push_back(d);
+    }
+  } catch (std::exception* e){
+    for (size_t i = 0; i < definitions.size(); i++){
+      delete definitions[i];
+    }
+    throw new ParseError(t.get_line(), t.get_column(), e->what());
+  }
+
+  try {
+    for (size_t i = 0; i < definitions.size(); i++){
+      const std::string& name = definitions[i]->get_name();
+      LLVMLock lock;
+      std::ostringstream version;
+      version << name << ".hot." << ++replacements;
+      get_engine();
+      llvm::Function* f = definitions[i]->generate_version(module, 
+                                                           global_symbols,
+                                                           version.str());
+      count_active_calls(ee, f);
+      Function* entry = functions->find_function(name);
+      void* code = ee->getPointerToFunction(f);
+      void** cell = (void**)ee->getPointerToGlobal(entry->get_cell());
+      /* the new code is complete before any thread can see it */
+      __sync_synchronize();
+      *(void* volatile*)cell = code;
+
+      std::map<std::string, llvm::Function*>::iterator live 
+        = live_versions.find(name);
+      if (live != live_versions.end()){
+        replaced.push_back(live->second);
+      }
+      live_versions[name] = f;
+      /* the tree no longer describes the code in the cell */
+      forget_unit(name);
+      if (log){
+        *log << "Replaced " << name << " with " << version.str() 
+             << std::endl;
+      }
+    }
+  } catch (std::exception* e){
+    for (size_t i = 0; i < definitions.size(); i++){
+      delete definitions[i];
+    }
+    throw;
+  }
+  for (size_t i = 0; i < definitions.size(); i++){
+    delete definitions[i];
+  }
+}
+
+int Compiler::free_replaced_code(){
+  LLVMLock lock;
+  std::vector<llvm::Function*> waiting;
+  int n = 0;
+
+  for (std::vector<llvm::Function*>::iterator i = retired.begin();
+       i != retired.end(); i++){
+    llvm::GlobalVariable* active = 
+      module->getGlobalVariable((*i)->getName() + ".active", true);
+    if (*(int volatile*)ee->getPointerToGlobal(active)){
+      waiting.push_back(*i);
+      continue;
+    }
+    ee->freeMachineCodeForFunction(*i);
+    (*i)->eraseFromParent();
+    n++;
+  }
+  waiting.insert(waiting.end(), replaced.begin(), replaced.end());
+  retired.swap(waiting);
+  replaced.clear();
+  return n;
+}
+
+/*
+ * Code budget: every tracked function sets a flag of its own when it
+ * is called. Sweeps turn the flags into last use times, eviction takes
+ * the function with the oldest one.
+ */
+struct ncc::CodeUnit {
+  /* in unit_table of the session */
+  unsigned int index;
+  FunctionDefinition* definition;
+  llvm::Function* function;
+  llvm::GlobalVariable* used;
+  /* what the cell points to while the function is evicted */
+  llvm::Function* reload;
+  bool evicted;
+  /* estimated bytes of machine code, 0 unless compiled */
+  size_t size;
+  size_t tree_size;
+  double last_use;
+};
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* 
+ * The JIT does not tell how much code it emitted for a function. Most
+ * instructions lower to one or two machine instructions of a few bytes.
+ */
+static const size_t bytes_per_instruction = 8;
+/* 
+ * A tree has about one node per instruction, each with a vtable, a few
+ * pointers and often a name.
+ */
+static const size_t bytes_per_node = 64;
+
+static size_t count_instructions(llvm::Function* f){
+  size_t n = 0;
+  for (llvm::Function::iterator b = f->begin(); b != f->end(); b++){
+    for (llvm::BasicBlock::iterator i = b->begin(); i != b->end(); i++){
+      n++;
+    }
+  }
+  return n;
+}
+
+/* sets the flag of the unit first thing in the body */
+static void mark_uses(CodeUnit* unit){
+  llvm::Function* f = unit->function;
+  if (!unit->used){
+    unit->used = 
+      new llvm::GlobalVariable(llvm::Type::Int8Ty,
+                               false,
+                               llvm::GlobalValue::InternalLinkage,
+                               llvm::ConstantInt::get(llvm::Type::Int8Ty, 0),
+                               f->getName() + ".used",
+                               f->getParent());
+  }
+  llvm::BasicBlock& entry = f->getEntryBlock();
+  llvm::LLVMBuilder builder;
+  builder.SetInsertPoint(&entry, entry.begin());
+  builder.CreateStore(llvm::ConstantInt::get(llvm::Type::Int8Ty, 1), 
+                      unit->used);
+}
+
+/* 
+ * Takes over a generated definition if its code may be evicted. The
+ * code of instrumented functions is more than its tree. The trees must
+ * fit the budget by themselves.
+ */
+bool Compiler::keep_unit(TopLevelForm* form){
+  const CodegenOptions& options = functions->get_options();
+  FunctionDefinition* d = dynamic_cast<FunctionDefinition*>(form);
+  if (!options.code_budget || !d || options.profile || options.specializer){
+    return false;
+  }
+  llvm::Function* f = module->getFunction(d->get_name());
+  if (!f || f->isDeclaration()){
+    return false;
+  }
+  size_t tree_size = count_instructions(f) * bytes_per_node;
+  if (tree_bytes + tree_size > options.code_budget){
+    return false;
+  }
+
+  CodeUnit* unit = new CodeUnit;
+  unit->index = unit_table.size();
+  unit->definition = d;
+  unit->function = f;
+  unit->used = NULL;
+  unit->reload = NULL;
+  unit->evicted = false;
+  unit->size = 0;
+  unit->tree_size = tree_size;
+  unit->last_use = now_ns();
+  mark_uses(unit);
+  units[d->get_name()] = unit;
+  unit_table.push_back(unit);
+  tree_bytes += tree_size;
+  return true;
+}
+
+void Compiler::forget_unit(const std::string& name){
+  std::map<std::string, CodeUnit*>::iterator i = units.find(name);
+  if (i != units.end()){
+    tree_bytes -= i->second->tree_size;
+    unit_table[i->second->index] = NULL;
+    delete i->second->definition;
+    delete i->second;
+    units.erase(i);
+  }
+}
+
+void Compiler::delete_units(){
+  for (std::map<std::string, CodeUnit*>::iterator i = units.begin();
+       i != units.end(); i++){
+    delete i->second->definition;
+    delete i->second;
+  }
+  units.clear();
+  unit_table.clear();
+  tree_bytes = 0;
+}
+
+/* notes which units ran since the last sweep, returns the bytes in use */
+size_t Compiler::sweep_units(){
+  double now = now_ns();
+  size_t resident = 0;
+
+  for (std::map<std::string, CodeUnit*>::iterator i = units.begin();
+       i != units.end(); i++){
+    CodeUnit* unit = i->second;
+    if (unit->evicted || !ee->getPointerToGlobalIfAvailable(unit->function)){
+      continue;
+    }
+    if (!unit->size){
+      unit->size = count_instructions(unit->function) 
+        * bytes_per_instruction;
+    }
+    char* used = (char*)ee->getPointerToGlobal(unit->used);
+    if (*used){
+      *used = 0;
+      unit->last_use = now;
+    }
+    resident += unit->size;
+  }
+  return resident;
+}
+
+/*
+ * Same signature as the function: asks the session for the code of the
+ * unit, which compiles it again, and passes the call on. The session
+ * is the address of the global ncc.session, which the JIT maps to it,
+ * so no pointer of ours is in the IR.
+ */
+llvm::Function* Compiler::reload_stub(CodeUnit* unit){
+  if (unit->reload){
+    return unit->reload;
+  }
+
+  const llvm::Type* byte_ptr = 
+    llvm::PointerType::getUnqual(llvm::Type::Int8Ty);
+  llvm::Function* reload_code = module->getFunction("ncc_reload_code");
+  if (!reload_code){
+    std::vector<const llvm::Type*> arg_types;
+    arg_types.push_back(byte_ptr);
+    arg_types.push_back(llvm::Type::Int32Ty);
+    reload_code = 
+      new llvm::Function(llvm::FunctionType::get(byte_ptr, arg_types, false),
+                         llvm::GlobalValue::ExternalLinkage,
+                         "ncc_reload_code",
+                         module);
+    ee->addGlobalMapping(reload_code, (void*)reload_unit);
+  }
+  llvm::GlobalVariable* session = module->getGlobalVariable("ncc.session");
+  if (!session){
+    session = new llvm::GlobalVariable(llvm::Type::Int8Ty, false,
+                                       llvm::GlobalValue::ExternalLinkage,
+                                       NULL, "ncc.session", module);
+    ee->addGlobalMapping(session, this);
+  }
+
+  llvm::Function* f = unit->function;
+  llvm::Function* stub = new llvm::Function(f->getFunctionType(),
+                                            llvm::GlobalValue::InternalLinkage,
+                                            f->getName() + ".reload",
+                                            module);
+  stub->setCallingConv(f->getCallingConv());
+  llvm::LLVMBuilder builder(new llvm::BasicBlock("entry", stub));
+  std::vector<llvm::Value*> handle;
+  handle.push_back(session);
+  handle.push_back(llvm::ConstantInt::get(llvm::Type::Int32Ty, unit->index));
+  llvm::Value* code = builder.CreateCall(reload_code, 
+                                         handle.begin(), handle.end(), 
+                                         "code");
+  llvm::Value* target = 
+    builder.CreateBitCast(code, llvm::PointerType::getUnqual(f->getFunctionType()),
+                          "target");
+  std::vector<llvm::Value*> a;
+  for (llvm::Function::arg_iterator i = stub->arg_begin(); 
+       i != stub->arg_end(); i++){
+    a.push_back(i);
+  }
+  llvm::CallInst* call = builder.CreateCall(target, a.begin(), a.end(), "rv");
+  call->setCallingConv(f->getCallingConv());
+  call->setTailCall();
+  builder.CreateRet(call);
+  unit->reload = stub;
+  return stub;
+}
+
+void Compiler::evict(CodeUnit* unit){
+  Function* entry = functions->find_function(unit->definition->get_name());
+  /* also emits the cell while the function still has its body */
+  void** cell = (void**)ee->getPointerToGlobal(entry->get_cell());
+  void* stub = ee->getPointerToFunction(reload_stub(unit));
+  __sync_synchronize();
+  *(void* volatile*)cell = stub;
+
+  ee->freeMachineCodeForFunction(unit->function);
+  unit->function->deleteBody();
+  unit->evicted = true;
+  unit->size = 0;
+  evictions++;
+}
+
+/* called from the stub, so errors cannot be thrown back */
+void* Compiler::reload(unsigned int index){
+  LLVMLock lock;
+  CodeUnit* unit = unit_table[index];
+  if (!unit){
+    /* the cell was pointed elsewhere when the unit went away */
+    abort();
+  }
+  const std::string& name = unit->definition->get_name();
+  void* code = NULL;
+
+  try {
+    Function* entry = functions->find_function(name);
+    void** cell = (void**)ee->getPointerToGlobal(entry->get_cell());
+    if (unit->evicted){
+      unit->definition->generate(module, global_symbols);
+      mark_uses(unit);
+      code = ee->getPointerToFunction(unit->function);
+      __sync_synchronize();
+      *(void* volatile*)cell = code;
+      unit->evicted = false;
+      reloads++;
+      if (log){
+        *log << "Reloaded " << name << std::endl;
+      }
+    } else {
+      /* another thread was first */
+      code = *cell;
+    }
+  } catch (std::exception* e){
+    std::string message = "cannot compile " + name + " again: " + e->what();
+    if (log){
+      *log << "Fatal Error: " << message << std::endl;
+    }
+    if (fatal_error){
+      fatal_error(message);
+    }
+    /* the stub has no code to pass the call on to */
+    abort();
+  }
+  unit->last_use = now_ns();
+  return code;
+}
+
+void* Compiler::reload_unit(void* session, unsigned int index){
+  return ((Compiler*)session)->reload(index);
+}
+
+int Compiler::trim_code(){
+  LLVMLock lock;
+  size_t budget = functions->get_options().code_budget;
+  int n = 0;
+
+  if (!ee || !budget){
+    return 0;
+  }
+  size_t resident = sweep_units() + tree_bytes;
+  while (resident > budget){
+    CodeUnit* coldest = NULL;
+    for (std::map<std::string, CodeUnit*>::iterator i = units.begin();
+         i != units.end(); i++){
+      CodeUnit* unit = i->second;
+      if (!unit->evicted && unit->size 
+          && (!coldest || unit->last_use < coldest->last_use)){
+        coldest = unit;
+      }
+    }
+    if (!coldest){
+      break;
+    }
+    resident -= coldest->size;
+    evict(coldest);
+    n++;
+  }
+  if (log && n){
+    *log << "Evicted " << n << " functions, an estimated " << resident 
+         << " bytes of code and trees left" << std::endl;
+  }
+  return n;
+}
+
+CodeMemoryStats Compiler::get_code_stats(){
+  LLVMLock lock;
+  CodeMemoryStats s;
+  s.budget = functions->get_options().code_budget;
+  s.resident = 0;
+  s.trees = tree_bytes;
+  s.units = units.size();
+  s.resident_units = 0;
+  s.evictions = evictions;
+  s.reloads = reloads;
+  if (ee){
+    s.resident = sweep_units();
+    for (std::map<std::string, CodeUnit*>::iterator i = units.begin();
+         i != units.end(); i++){
+      if (i->second->size){
+        s.resident_units++;
+      }
+    }
+  }
+  return s;
+}
+
+void Compiler::print_code_stats(std::ostream& stream){
+  CodeMemoryStats s = get_code_stats();
+  stream << "Code budget: " << s.budget << " bytes, estimated " 
+         << s.resident << " in code and " << s.trees 
+         << " in trees (from instruction counts)" << std::endl;
+  stream << "Functions: " << s.units << " tracked, " << s.resident_units 
+         << " compiled, " << s.evictions << " evictions, " << s.reloads 
+         << " reloads" << std::endl;
+}
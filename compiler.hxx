@@ -0,0 +1,270 @@
+#ifndef HXX__ncc__compiler__
+#define HXX__ncc__compiler__
+
+#include "symbol.hxx"
+#include "cache.hxx"
+#include "split.hxx"
+#include "token.hxx"
+
+#include "llvm/Module.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <istream>
+#include <ostream>
+
+namespace ncc {
+  class FunctionDefinition;
+  class TopLevelForm;
+  struct SourceForm;
+  struct CodeUnit;
+
+  /* 
+   * Called when the code of an evicted function cannot be generated
+   * again. The call waiting for it has nowhere to go, so the handler
+   * must not return; the process aborts if it does.
+   */
+  typedef void (*FatalErrorHandler)(const std::string& message);
+
+  struct CodeMemoryStats {
+    size_t budget;
+    /* estimated bytes of machine code of the functions compiled now */
+    size_t resident;
+    /* estimated bytes of the trees kept to generate code again */
+    size_t trees;
+    unsigned int units;
+    unsigned int resident_units;
+    unsigned long evictions;
+    unsigned long reloads;
+  };
+
+  /*
+   * A compiler session: one module and its symbol tables. Sources can
+   * be added at any time before and after the first function pointer
+   * has been handed out; the JIT picks up new functions on demand.
+   * All sessions of a process share one JIT, LLVM keeps its state in
+   * globals.
+   */
+  class Compiler {
+  protected:
+    FunctionTable* functions;
+    SymbolTable* global_symbols;
+    llvm::Module* module;
+    /* the process JIT, once the module has been added to it */
+    llvm::ExecutionEngine* ee;
+    llvm::ModuleProvider* provider;
+    std::string cpu;
+    std::string attrs;
+    bool compiled;
+    bool optimized;
+    bool lazy;
+    int parse_jobs;
+    bool pretokenize;
+    bool streaming;
+    CodeCache* cache;
+    std::string cache_salt;
+    /* what a cache entry for the session is looked up by */
+    std::string cache_material;
+    std::ostream* ast_dump;
+    std::ostream* log;
+    /* token hashes of the forms given to recompile(), by kind and name */
+    std::map<std::string, std::string> form_hashes;
+    /* 
+     * Latest versions from replace(), the ones they replaced since the
+     * last free_replaced_code() and those that it could not free yet.
+     */
+    int replacements;
+    std::map<std::string, llvm::Function*> live_versions;
+    std::vector<llvm::Function*> replaced;
+    std::vector<llvm::Function*> retired;
+    /* functions that can be evicted under a code budget, by name */
+    std::map<std::string, CodeUnit*> units;
+    /* the same by the index their reload stubs pass, NULL once gone */
+    std::vector<CodeUnit*> unit_table;
+    bool auto_trim;
+    size_t tree_bytes;
+    unsigned long evictions;
+    unsigned long reloads;
+    FatalErrorHandler fatal_error;
+
+    void generate(Tokenizer& t);
+    void generate_streaming(Tokenizer& t);
+    void generate_parallel(const char* source,
+                           const std::vector<SourceChunk>& chunks);
+    std::string get_configuration();
+    bool load_cached(const std::string& material);
+    void import_globals();
+    llvm::Function* get_entry(const std::string& name);
+    void compile_pending();
+    void release_engine();
+    void reset();
+    bool can_regenerate(FunctionDefinition* d);
+    void regenerate_function(FunctionDefinition* d);
+    int regenerate(const std::vector<SourceForm>& forms,
+                   const std::set<std::string>& changed);
+    void reinitialize_globals(const std::map<std::string, 
+                                             std::string>& forms);
+    bool keep_unit(TopLevelForm* form);
+    void forget_unit(const std::string& name);
+    void delete_units();
+    size_t sweep_units();
+    llvm::Function* reload_stub(CodeUnit* unit);
+    void evict(CodeUnit* unit);
+    void* reload(unsigned int index);
+    static void* reload_unit(void* session, unsigned int index);
+  public:
+    Compiler(const CodegenOptions& options);
+    virtual ~Compiler();
+
+    void set_target(const std::string& cpu, const std::string& attrs){
+      this->cpu = cpu;
+      this->attrs = attrs;
+    }
+    void set_ast_dump(std::ostream* stream){
+      ast_dump = stream;
+    }
+    void set_log(std::ostream* stream){
+      log = stream;
+    }
+    void set_fatal_error_handler(FatalErrorHandler handler){
+      fatal_error = handler;
+    }
+    /*
+     * Lazy sessions compile a function the first time it is called,
+     * calls to the others go through stubs that compile and patch.
+     * Otherwise everything is compiled before code of the session runs
+     * or is handed out. Stubs compile without the session lock, so
+     * sessions used from several threads must not be lazy. Neither can
+     * a session that shares the JIT with others: the first session to
+     * be joined is compiled in full and the rest start out eager.
+     */
+    void set_lazy(bool lazy){
+      this->lazy = lazy;
+    }
+    /*
+     * Sessions with a code budget trim their code when compile() is
+     * called and when run_main() returns. Hosts running code of the
+     * session on other threads meanwhile turn that off and call
+     * trim_code() themselves.
+     */
+    void set_auto_trim(bool trim){
+      auto_trim = trim;
+    }
+    /* threads for parsing large buffers */
+    void set_parse_jobs(int jobs){
+      parse_jobs = jobs;
+    }
+    /* tokenize buffers in one pass before parsing them */
+    void set_pretokenize(bool pretokenize){
+      this->pretokenize = pretokenize;
+    }
+    /*
+     * Generate function bodies while parsing them, without keeping
+     * their trees. Parsing then runs on the calling thread only.
+     */
+    void set_streaming(bool streaming){
+      this->streaming = streaming;
+    }
+    /* 
+     * The first source given as a buffer is looked up in the cache;
+     * salt covers inputs the session cannot see, like profiles.
+     */
+    void set_cache(CodeCache* cache, const std::string& salt){
+      this->cache = cache;
+      cache_salt = salt;
+    }
+
+    void compile(std::istream& is);
+    void compile(const char* source, size_t length);
+    void compile(const std::string& source){
+      compile(source.data(), source.size());
+    }
+    void compile_files(const std::vector<std::string>& files, int jobs);
+    /*
+     * Replace the whole source of the session. Only functions whose
+     * tokens changed, or whose callees changed what they may do, are
+     * generated again and recompiled in place; other changes rebuild
+     * the session. Either way globals start from their initial values.
+     * Returns the number of functions generated.
+     */
+    int recompile(const char* source, size_t length);
+    int recompile(const std::string& source){
+      return recompile(source.data(), source.size());
+    }
+    /*
+     * Hot swapping, for sessions with the hot_swap option: compiles new
+     * versions of existing functions and switches their cells over while
+     * code of the session keeps running. Calls in progress finish in the
+     * old version. Compiling happens on the calling thread under the
+     * session lock; hosts wanting it in the background can submit it to
+     * a thread of their own.
+     */
+    void replace(const char* source, size_t length);
+    void replace(const std::string& source){
+      replace(source.data(), source.size());
+    }
+    /* 
+     * Frees the code of replaced versions that no call is in, counted
+     * on entry and return of every version. A version is only freed
+     * once a call after the one that saw it replaced finds it unused:
+     * a thread that read the cell before the switch but has not entered
+     * the version yet is not counted. Can be called while code of the
+     * session runs, at intervals longer than such a delay. Returns the
+     * number of versions freed.
+     */
+    int free_replaced_code();
+    /*
+     * Sessions with a code_budget keep the trees of their functions and
+     * call through cells. The trees count against the budget, functions
+     * whose tree no longer fits stay compiled. This evicts the machine
+     * code and IR of the least recently used ones until the code still
+     * compiled and the trees fit the budget; an evicted function is
+     * generated and compiled again on its next call. Only call this
+     * where no thread is running code of the session, see also
+     * set_auto_trim(). Sizes are
+     * estimated from instruction counts, the JIT does not report them.
+     * Returns the number of functions evicted.
+     */
+    int trim_code();
+    CodeMemoryStats get_code_stats();
+    void print_code_stats(std::ostream& stream);
+    void link(Compiler* other);
+    void optimize();
+
+    llvm::Module* get_module(){
+      return module;
+    }
+    FunctionTable* get_functions(){
+      return functions;
+    }
+    llvm::ExecutionEngine* get_engine();
+    int count_compiled_functions();
+
+    void* get_function_pointer(const std::string& name);
+    /* T is the C signature of the function, e.g. int (*)(int, int) */
+    template <typename T>
+    T get_function(const std::string& name){
+      union {
+        void* object;
+        T function;
+      } p;
+      p.object = get_function_pointer(name);
+      return p.function;
+    }
+    int run_main(const std::vector<std::string>& args, 
+                 const char* const* envp);
+    /* 
+     * Runs main in a child process, so that exit() or a crash ends
+     * only the child. Says how main ended. With output, the child reads
+     * no input and what it writes to stdout and stderr ends up there.
+     */
+    std::string run_main_forked(const std::vector<std::string>& args, 
+                                const char* const* envp,
+                                std::string* output = NULL);
+  };
+}
+
+#endif
@@ -0,0 +1,404 @@
+#include "emit.hxx"
+#include "target.hxx"
+#include "exceptions.hxx"
+#include "lock.hxx"
+
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/ModuleProvider.h"
+#include "llvm/PassManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetMachineRegistry.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Support/LLVMBuilder.h"
+
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using namespace ncc;
+
+void ncc::emit_bitcode(llvm::Module* module, const std::string& file){
+  LLVMLock lock;
+  std::ofstream os(file.c_str(), std::ios::out | std::ios::binary);
+  if (!os){
+    throw new EmitError("cannot open " + file);
+  }
+  llvm::WriteBitcodeToFile(module, os);
+  os.close();
+  if (!os){
+    throw new EmitError("cannot write " + file);
+  }
+}
+
+static const std::string CLONES_PREFIX = "ncc.clones.";
+
+/* the list is a string of comma separated ISAs */
+void ncc::note_target_clones(llvm::Module* module, const std::string& name,
+                             const std::vector<std::string>& isas){
+  std::string list;
+  for (std::vector<std::string>::const_iterator i = isas.begin();
+       i != isas.end(); i++){
+    if (!list.empty()){
+      list += ",";
+    }
+    list += *i;
+  }
+  forget_target_clones(module, name);
+  llvm::Constant* c = llvm::ConstantArray::get(list, false);
+  new llvm::GlobalVariable(c->getType(),
+                           true,
+                           llvm::GlobalValue::InternalLinkage,
+                           c,
+                           CLONES_PREFIX + name,
+                           module);
+}
+
+void ncc::forget_target_clones(llvm::Module* module, const std::string& name){
+  llvm::GlobalVariable* g = 
+    module->getGlobalVariable(CLONES_PREFIX + name, true);
+  if (g){
+    g->eraseFromParent();
+  }
+}
+
+typedef std::map<std::string, std::vector<std::string> > CloneMap;
+
+/* the clone lists of module, which go away */
+static CloneMap take_target_clones(llvm::Module* module){
+  CloneMap clones;
+  std::vector<llvm::GlobalVariable*> markers;
+
+  for (llvm::Module::global_iterator i = module->global_begin();
+       i != module->global_end(); i++){
+    if (i->getName().compare(0, CLONES_PREFIX.size(), CLONES_PREFIX) != 0){
+      continue;
+    }
+    std::string name = i->getName().substr(CLONES_PREFIX.size());
+    std::string list = 
+      llvm::cast<llvm::ConstantArray>(i->getInitializer())->getAsString();
+    std::string::size_type start = 0;
+    while (start <= list.size()){
+      std::string::size_type end = list.find(',', start);
+      if (end == std::string::npos){
+        end = list.size();
+      }
+      clones[name].push_back(list.substr(start, end - start));
+      start = end + 1;
+    }
+    markers.push_back(&*i);
+  }
+  for (std::vector<llvm::GlobalVariable*>::iterator i = markers.begin();
+       i != markers.end(); i++){
+    (*i)->eraseFromParent();
+  }
+  return clones;
+}
+
+static bool has_clone(const CloneMap& clones, const std::string& name,
+                      const std::string& isa){
+  CloneMap::const_iterator c = clones.find(name);
+  if (c == clones.end()){
+    return false;
+  }
+  for (std::vector<std::string>::const_iterator i = c->second.begin();
+       i != c->second.end(); i++){
+    if (*i == isa){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* libgcc fills it in from CPUID, in a constructor ahead of ours */
+static llvm::GlobalVariable* cpu_model(llvm::Module* module){
+  llvm::GlobalVariable* g = module->getGlobalVariable("__cpu_model");
+  if (g){
+    return g;
+  }
+  /* vendor, type and subtype come before the feature bits */
+  return new llvm::GlobalVariable(llvm::ArrayType::get(llvm::Type::Int32Ty, 4),
+                                  false,
+                                  llvm::GlobalValue::ExternalLinkage,
+                                  NULL,
+                                  "__cpu_model",
+                                  module);
+}
+
+/*
+ * The body of f moves to NAME.default, f itself calls the first clone
+ * the CPU supports or else the default. The choice is made on the first
+ * call and cached, like a lazily bound PLT entry.
+ */
+static void generate_dispatcher(llvm::Function* f,
+                                const std::vector<std::string>& isas){
+  llvm::Module* module = f->getParent();
+  const llvm::FunctionType* t = f->getFunctionType();
+  const llvm::PointerType* fptr = llvm::PointerType::getUnqual(t);
+  llvm::GlobalValue::LinkageTypes linkage = f->getLinkage();
+  llvm::DenseMap<const llvm::Value*, llvm::Value*> vmap;
+
+  llvm::Function* fallback = llvm::CloneFunction(f, vmap);
+  fallback->setName(f->getName() + ".default");
+  fallback->setLinkage(llvm::GlobalValue::InternalLinkage);
+  fallback->setCallingConv(f->getCallingConv());
+  module->getFunctionList().push_back(fallback);
+  f->deleteBody();
+  f->setLinkage(linkage);
+
+  llvm::GlobalVariable* resolved = 
+    new llvm::GlobalVariable(fptr,
+                             false,
+                             llvm::GlobalValue::InternalLinkage,
+                             llvm::ConstantPointerNull::get(fptr),
+                             f->getName() + ".resolved",
+                             module);
+
+  llvm::BasicBlock* entry = new llvm::BasicBlock("entry", f);
+  llvm::BasicBlock* resolve = new llvm::BasicBlock("resolve", f);
+  llvm::BasicBlock* call = new llvm::BasicBlock("call", f);
+  llvm::LLVMBuilder builder(entry);
+  llvm::Value* cached = builder.CreateLoad(resolved, "cached");
+  llvm::Value* c = builder.CreateICmpEQ(cached, 
+                                        llvm::ConstantPointerNull::get(fptr),
+                                        "unresolved");
+  builder.CreateCondBr(c, resolve, call);
+
+  builder.SetInsertPoint(resolve);
+  std::vector<llvm::Value*> index;
+  index.push_back(llvm::ConstantInt::get(llvm::Type::Int32Ty, 0));
+  index.push_back(llvm::ConstantInt::get(llvm::Type::Int32Ty, 3));
+  llvm::Value* features = 
+    builder.CreateLoad(builder.CreateGEP(cpu_model(module), 
+                                         index.begin(), index.end(), 
+                                         "features"),
+                       "features");
+  llvm::Value* chosen = fallback;
+  for (std::vector<std::string>::const_reverse_iterator i = isas.rbegin();
+       i != isas.rend(); i++){
+    /* the parts of the assembly define the clones */
+    llvm::Function* clone = new llvm::Function(t, 
+                                               llvm::GlobalValue::ExternalLinkage,
+                                               f->getName() + "." + *i,
+                                               module);
+    clone->setCallingConv(f->getCallingConv());
+    unsigned int bit = 1U << get_clone_feature_bit(*i);
+    llvm::Value* has = 
+      builder.CreateAnd(features, 
+                        llvm::ConstantInt::get(llvm::Type::Int32Ty, bit),
+                        i->c_str());
+    has = builder.CreateICmpNE(has, 
+                               llvm::ConstantInt::get(llvm::Type::Int32Ty, 0),
+                               i->c_str());
+    chosen = builder.CreateSelect(has, clone, chosen, "chosen");
+  }
+  builder.CreateStore(chosen, resolved);
+  builder.CreateBr(call);
+
+  builder.SetInsertPoint(call);
+  llvm::PHINode* target = builder.CreatePHI(fptr, "target");
+  target->addIncoming(cached, entry);
+  target->addIncoming(chosen, resolve);
+  std::vector<llvm::Value*> a;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++){
+    a.push_back(i);
+  }
+  llvm::CallInst* rv = builder.CreateCall(target, a.begin(), a.end(), "rv");
+  rv->setCallingConv(f->getCallingConv());
+  rv->setTailCall();
+  builder.CreateRet(rv);
+}
+
+/* 
+ * Leaves the clones for isa as the only definitions of module, internal
+ * under NAME.isa. Everything else is only declared, the rest of the
+ * assembly defines it.
+ */
+static void keep_clones(llvm::Module* module, const CloneMap& clones,
+                        const std::string& isa){
+  std::vector<llvm::Function*> kept;
+
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    if (i->isDeclaration()){
+      continue;
+    }
+    if (has_clone(clones, i->getName(), isa)){
+      kept.push_back(&*i);
+    } else {
+      i->deleteBody();
+      i->setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+  }
+  for (llvm::Module::global_iterator i = module->global_begin();
+       i != module->global_end(); i++){
+    if (i->hasInitializer()){
+      i->setInitializer(NULL);
+      i->setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+  }
+  for (std::vector<llvm::Function*>::iterator i = kept.begin();
+       i != kept.end(); i++){
+    (*i)->setName((*i)->getName() + "." + isa);
+    (*i)->setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
+}
+
+static bool is_symbol_char(char c){
+  return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$';
+}
+
+/*
+ * Appends the assembly of a clone part to file. Every part numbers its
+ * basic block and constant pool labels from 0, so the private .L
+ * labels of the part get the ISA into their names.
+ */
+static void append_part(const std::string& file, const std::string& part,
+                        const std::string& isa){
+  std::ifstream is(part.c_str());
+  std::ofstream os(file.c_str(), std::ios::out | std::ios::app);
+  std::string line;
+  if (!is || !os){
+    throw new EmitError("cannot append " + part + " to " + file);
+  }
+  while (std::getline(is, line)){
+    for (std::string::size_type i = 0; i + 1 < line.size(); i++){
+      if (line[i] == '.' && line[i + 1] == 'L'
+          && (i == 0 || !is_symbol_char(line[i - 1]))){
+        line.insert(i + 2, isa + "_");
+      }
+    }
+    os << line << "\n";
+  }
+  os.close();
+  if (!os){
+    throw new EmitError("cannot write " + file);
+  }
+}
+
+static void emit_module(llvm::Module* module, const std::string& file,
+                        const std::string& cpu, const std::string& attrs){
+  std::string error;
+  const llvm::TargetMachineRegistry::Entry* arch = 
+    llvm::TargetMachineRegistry::getClosestStaticTargetForModule(*module,
+                                                                 error);
+  if (!arch){
+    throw new EmitError("no target for this module: " + error);
+  }
+
+  /* subtarget strings start with the CPU name, empty for the default */
+  std::string features = (cpu == "native") ? "" : cpu;
+  std::string extra = get_target_features(cpu, attrs);
+  if (!extra.empty()){
+    features += "," + extra;
+  }
+  std::auto_ptr<llvm::TargetMachine> target(arch->CtorFn(*module, features));
+
+  std::ofstream os(file.c_str());
+  if (!os){
+    throw new EmitError("cannot open " + file);
+  }
+
+  llvm::ExistingModuleProvider mp(module);
+  {
+    llvm::FunctionPassManager passes(&mp);
+    passes.add(new llvm::TargetData(*target->getTargetData()));
+    if (target->addPassesToEmitFile(passes, os, 
+                                    llvm::TargetMachine::AssemblyFile,
+                                    false) != llvm::FileModel::AsmFile
+        || target->addPassesToEmitFileFinish(passes, NULL, false)){
+      mp.releaseModule();
+      throw new EmitError("target cannot emit assembly");
+    }
+
+    passes.doInitialization();
+    for (llvm::Module::iterator i = module->begin(); 
+         i != module->end(); i++){
+      if (!i->isDeclaration()){
+        passes.run(*i);
+      }
+    }
+    passes.doFinalization();
+  }
+  mp.releaseModule();
+
+  os.close();
+  if (!os){
+    throw new EmitError("cannot write " + file);
+  }
+}
+
+/*
+ * Our code generator compiles a module for one subtarget, so the clones
+ * for each ISA are a module of their own, compiled with the ISA turned
+ * on. Their assembly goes into the file of the rest, where it can refer
+ * to internal functions and globals by name.
+ */
+void ncc::emit_assembly(llvm::Module* module, const std::string& file,
+                        const std::string& cpu, const std::string& attrs){
+  LLVMLock lock;
+  std::auto_ptr<llvm::Module> base(llvm::CloneModule(module));
+  CloneMap clones = take_target_clones(base.get());
+  std::set<std::string> isas;
+
+  for (CloneMap::iterator i = clones.begin(); i != clones.end(); i++){
+    llvm::Function* f = base->getFunction(i->first);
+    /* inlined everywhere by whole program optimization */
+    if (!f || f->isDeclaration()){
+      continue;
+    }
+    generate_dispatcher(f, i->second);
+    isas.insert(i->second.begin(), i->second.end());
+  }
+  emit_module(base.get(), file, cpu, attrs);
+
+  for (std::set<std::string>::iterator i = isas.begin(); 
+       i != isas.end(); i++){
+    std::auto_ptr<llvm::Module> clone(llvm::CloneModule(module));
+    std::string part = file + "." + *i + ".tmp";
+    take_target_clones(clone.get());
+    keep_clones(clone.get(), clones, *i);
+    try {
+      emit_module(clone.get(), part, cpu, get_clone_attrs(attrs, *i));
+      append_part(file, part, *i);
+    } catch (std::exception* e){
+      unlink(part.c_str());
+      throw;
+    }
+    unlink(part.c_str());
+  }
+}
+
+/* 
+ * The object writers of the code generator do not handle our targets
+ * yet, so the system assembler turns the assembly into an object.
+ */
+void ncc::emit_object(llvm::Module* module, const std::string& file,
+                      const std::string& cpu, const std::string& attrs){
+  std::string assembly = file + ".s.tmp";
+  int status;
+
+  emit_assembly(module, assembly, cpu, attrs);
+
+  pid_t pid = fork();
+  if (pid == 0){
+    execlp("as", "as", "-o", file.c_str(), assembly.c_str(), (char*)NULL);
+    _exit(127);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid 
+      || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+    unlink(assembly.c_str());
+    throw new EmitError("assembler failed on " + file);
+  }
+  unlink(assembly.c_str());
+}
@@ -0,0 +1,24 @@
+#ifndef HXX__ncc__emit__
+#define HXX__ncc__emit__
+
+#include "llvm/Module.h"
+
+#include <string>
+#include <vector>
+
+namespace ncc {
+  /*
+   * [[target_clones]] leaves the ISAs of a function in the module, for
+   * the assembly to get a clone of it for each of them.
+   */
+  void note_target_clones(llvm::Module* module, const std::string& name,
+                          const std::vector<std::string>& isas);
+  void forget_target_clones(llvm::Module* module, const std::string& name);
+  void emit_bitcode(llvm::Module* module, const std::string& file);
+  void emit_assembly(llvm::Module* module, const std::string& file,
+                     const std::string& cpu, const std::string& attrs);
+  void emit_object(llvm::Module* module, const std::string& file,
+                   const std::string& cpu, const std::string& attrs);
+}
+
+#endif
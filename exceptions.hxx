@@ -4,6 +4,7 @@
 #include "types.hxx"
 
 #include <string>
+#include <sstream>
 #include <exception>
 
 namespace ncc {
@@ -40,6 +41,14 @@ namespace ncc {
       return "Invalid token";
     }    
   };
+  class ExpectedLValue : public std::exception {
+  public:
+    ExpectedLValue() throw() {};
+    virtual ~ExpectedLValue() throw() {};
+    virtual const char* what() const throw () {
+      return "l-value expected";
+    }    
+  };
   class FeatureNotImplemented : public std::exception {
   private:
     std::string message;
@@ -81,6 +90,172 @@ namespace ncc {
       return message.c_str();
     }
   };
+  class SymbolRedefined : public std::exception {
+  private:
+    std::string message;
+  public:
+    SymbolRedefined(const std::string& name) throw(): 
+      message("Symbol redefined: " + name) {}
+    virtual ~SymbolRedefined() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class TooFewArguments : public std::exception {
+  private:
+    std::string message;
+  public:
+    TooFewArguments(const std::string& func) throw(): 
+      message("Too few arguments passed to " + func) {}
+    virtual ~TooFewArguments() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class UnknownAttribute : public std::exception {
+  private:
+    std::string message;
+  public:
+    UnknownAttribute(const std::string& name) throw(): 
+      message("Unknown attribute: " + name) {}
+    virtual ~UnknownAttribute() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class MisplacedAttribute : public std::exception {
+  private:
+    std::string message;
+  public:
+    MisplacedAttribute(const std::string& name) throw(): 
+      message("Attribute needs a function body: " + name) {}
+    virtual ~MisplacedAttribute() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class InvalidAttributeArguments : public std::exception {
+  private:
+    std::string message;
+  public:
+    InvalidAttributeArguments(const std::string& name) throw(): 
+      message("Invalid arguments for attribute: " + name) {}
+    virtual ~InvalidAttributeArguments() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class UnknownFPModel : public std::exception {
+  private:
+    std::string message;
+  public:
+    UnknownFPModel(const std::string& name) throw(): 
+      message("Unknown floating point model: " + name) {}
+    virtual ~UnknownFPModel() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class ProfileError : public std::exception {
+  private:
+    std::string message;
+  public:
+    ProfileError(const std::string& message) throw(): 
+      message("Profile error: " + message) {}
+    virtual ~ProfileError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class CacheError : public std::exception {
+  private:
+    std::string message;
+  public:
+    CacheError(const std::string& message) throw(): 
+      message("Code cache: " + message) {}
+    virtual ~CacheError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class EmitError : public std::exception {
+  private:
+    std::string message;
+  public:
+    EmitError(const std::string& message) throw(): 
+      message("Cannot emit code: " + message) {}
+    virtual ~EmitError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class LinkError : public std::exception {
+  private:
+    std::string message;
+  public:
+    LinkError(const std::string& message) throw(): 
+      message("Link error: " + message) {}
+    virtual ~LinkError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class CompileError : public std::exception {
+  private:
+    std::string message;
+  public:
+    CompileError(const std::string& message) throw(): 
+      message(message) {}
+    virtual ~CompileError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class ServerError : public std::exception {
+  private:
+    std::string message;
+  public:
+    ServerError(const std::string& message) throw(): 
+      message("Compile server: " + message) {}
+    virtual ~ServerError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class InvalidArgument : public std::exception {
+  private:
+    std::string message;
+  public:
+    InvalidArgument(const std::string& text) throw(): 
+      message("Invalid argument: " + text) {}
+    virtual ~InvalidArgument() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+  };
+  class ParseError : public std::exception {
+  private:
+    std::string message;
+    int line;
+    int column;
+  public:
+    ParseError(int line, int column, const std::string& error) throw():
+      line(line), column(column) {
+      std::ostringstream s;
+      s << line << ":" << column << ": " << error;
+      message = s.str();
+    }
+    virtual ~ParseError() throw() {};
+    virtual const char* what() const throw () {
+      return message.c_str();
+    }
+    int get_line() const {
+      return line;
+    }
+    int get_column() const {
+      return column;
+    }
+  };
 }
 
 #endif
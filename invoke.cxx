@@ -0,0 +1,246 @@
+#include "invoke.hxx"
+#include "exceptions.hxx"
+
+#include <cstdlib>
+#include <cerrno>
+#include <sstream>
+
+using namespace ncc;
+
+template <typename F>
+static F to_function(void* p){
+  union {
+    void* object;
+    F function;
+  } u;
+  u.object = p;
+  return u.function;
+}
+
+template <typename T> static T get(const NativeValue& v);
+template <> int get<int>(const NativeValue& v){
+  return v.integer;
+}
+template <> double get<double>(const NativeValue& v){
+  return v.real;
+}
+
+static void set(NativeValue& v, int x){
+  v.integer = x;
+}
+static void set(NativeValue& v, double x){
+  v.real = x;
+}
+
+template <typename R>
+struct Invoke {
+  static NativeValue call0(void* f, const NativeValue* a){
+    NativeValue r;
+    set(r, to_function<R (*)()>(f)());
+    return r;
+  }
+  template <typename A1>
+  static NativeValue call1(void* f, const NativeValue* a){
+    NativeValue r;
+    set(r, to_function<R (*)(A1)>(f)(get<A1>(a[0])));
+    return r;
+  }
+  template <typename A1, typename A2>
+  static NativeValue call2(void* f, const NativeValue* a){
+    NativeValue r;
+    set(r, to_function<R (*)(A1, A2)>(f)(get<A1>(a[0]), get<A2>(a[1])));
+    return r;
+  }
+  template <typename A1, typename A2, typename A3>
+  static NativeValue call3(void* f, const NativeValue* a){
+    NativeValue r;
+    set(r, to_function<R (*)(A1, A2, A3)>(f)(get<A1>(a[0]), get<A2>(a[1]),
+                                              get<A3>(a[2])));
+    return r;
+  }
+  template <typename A1, typename A2, typename A3, typename A4>
+  static NativeValue call4(void* f, const NativeValue* a){
+    NativeValue r;
+    set(r, to_function<R (*)(A1, A2, A3, A4)>(f)(get<A1>(a[0]), 
+                                                  get<A2>(a[1]),
+                                                  get<A3>(a[2]),
+                                                  get<A4>(a[3])));
+    return r;
+  }
+};
+
+template <>
+struct Invoke<void> {
+  static NativeValue call0(void* f, const NativeValue* a){
+    NativeValue r;
+    to_function<void (*)()>(f)();
+    r.integer = 0;
+    return r;
+  }
+  template <typename A1>
+  static NativeValue call1(void* f, const NativeValue* a){
+    NativeValue r;
+    to_function<void (*)(A1)>(f)(get<A1>(a[0]));
+    r.integer = 0;
+    return r;
+  }
+  template <typename A1, typename A2>
+  static NativeValue call2(void* f, const NativeValue* a){
+    NativeValue r;
+    to_function<void (*)(A1, A2)>(f)(get<A1>(a[0]), get<A2>(a[1]));
+    r.integer = 0;
+    return r;
+  }
+  template <typename A1, typename A2, typename A3>
+  static NativeValue call3(void* f, const NativeValue* a){
+    NativeValue r;
+    to_function<void (*)(A1, A2, A3)>(f)(get<A1>(a[0]), get<A2>(a[1]),
+                                          get<A3>(a[2]));
+    r.integer = 0;
+    return r;
+  }
+  template <typename A1, typename A2, typename A3, typename A4>
+  static NativeValue call4(void* f, const NativeValue* a){
+    NativeValue r;
+    to_function<void (*)(A1, A2, A3, A4)>(f)(get<A1>(a[0]), get<A2>(a[1]),
+                                              get<A3>(a[2]), get<A4>(a[3]));
+    r.integer = 0;
+    return r;
+  }
+};
+
+/*
+ * Each select_<n> has fixed the first n argument types and picks the
+ * next one, until all of them are known.
+ */
+template <typename R, typename A1, typename A2, typename A3>
+static NativeInvoker select_3(const std::vector<ValueType>& t){
+  if (t.size() == 3){
+    return &Invoke<R>::template call3<A1, A2, A3>;
+  }
+  if (t[3] == TYPE_INTEGER){
+    return &Invoke<R>::template call4<A1, A2, A3, int>;
+  }
+  return &Invoke<R>::template call4<A1, A2, A3, double>;
+}
+
+template <typename R, typename A1, typename A2>
+static NativeInvoker select_2(const std::vector<ValueType>& t){
+  if (t.size() == 2){
+    return &Invoke<R>::template call2<A1, A2>;
+  }
+  if (t[2] == TYPE_INTEGER){
+    return select_3<R, A1, A2, int>(t);
+  }
+  return select_3<R, A1, A2, double>(t);
+}
+
+template <typename R, typename A1>
+static NativeInvoker select_1(const std::vector<ValueType>& t){
+  if (t.size() == 1){
+    return &Invoke<R>::template call1<A1>;
+  }
+  if (t[1] == TYPE_INTEGER){
+    return select_2<R, A1, int>(t);
+  }
+  return select_2<R, A1, double>(t);
+}
+
+template <typename R>
+static NativeInvoker select_0(const std::vector<ValueType>& t){
+  if (t.size() == 0){
+    return &Invoke<R>::call0;
+  }
+  if (t[0] == TYPE_INTEGER){
+    return select_1<R, int>(t);
+  }
+  return select_1<R, double>(t);
+}
+
+NativeInvoker ncc::get_native_invoker(ValueType ret_type, 
+                                      const std::vector<ValueType>& arg_types){
+  if (arg_types.size() > max_invoke_arguments){
+    throw new FeatureNotImplemented("native calls with more than four "
+                                    "arguments");
+  }
+  for (std::vector<ValueType>::const_iterator i = arg_types.begin();
+       i != arg_types.end(); i++){
+    if (*i != TYPE_INTEGER && *i != TYPE_DOUBLE){
+      throw new FeatureNotImplemented("native calls with pointer arguments");
+    }
+  }
+
+  switch (ret_type){
+  case TYPE_VOID:
+    return select_0<void>(arg_types);
+  case TYPE_INTEGER:
+    return select_0<int>(arg_types);
+  case TYPE_DOUBLE:
+    return select_0<double>(arg_types);
+  default:
+    throw new FeatureNotImplemented("native calls returning pointers");
+  }
+}
+
+NativeValue ncc::parse_native_value(ValueType type, const std::string& text){
+  NativeValue v;
+  char* end;
+
+  errno = 0;
+  if (type == TYPE_INTEGER){
+    long l = std::strtol(text.c_str(), &end, 0);
+    v.integer = (int)l;
+    if (l != v.integer){
+      errno = ERANGE;
+    }
+  } else {
+    v.real = std::strtod(text.c_str(), &end);
+  }
+  if (text.empty() || *end || errno){
+    throw new InvalidArgument(text);
+  }
+  return v;
+}
+
+std::string ncc::format_native_value(ValueType type, NativeValue value){
+  std::ostringstream s;
+  switch (type){
+  case TYPE_INTEGER:
+    s << value.integer;
+    break;
+  case TYPE_DOUBLE:
+    s << value.real;
+    break;
+  default:
+    s << "void";
+  }
+  return s.str();
+}
+
+std::string ncc::parse_call(FunctionTable* ft, const std::string& spec,
+                            std::vector<NativeValue>& args){
+  std::string::size_type colon = spec.find(':');
+  std::string name = spec.substr(0, colon);
+  Function& f = ft->get_function(name);
+  
+  if (colon != std::string::npos && colon + 1 < spec.size()){
+    std::string list = spec.substr(colon + 1);
+    std::string::size_type start = 0;
+    while (start <= list.size()){
+      std::string::size_type comma = list.find(',', start);
+      if (comma == std::string::npos){
+        comma = list.size();
+      }
+      if ((int)args.size() >= f.get_arg_count()){
+        throw new TooManyArguments(name);
+      }
+      args.push_back(parse_native_value(f.get_arg_type(args.size()),
+                                        list.substr(start, comma - start)));
+      start = comma + 1;
+    }
+  }
+  if ((int)args.size() < f.get_arg_count()){
+    throw new TooFewArguments(name);
+  }
+  return name;
+}
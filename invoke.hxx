@@ -0,0 +1,34 @@
+#ifndef HXX__ncc__invoke__
+#define HXX__ncc__invoke__
+
+#include "types.hxx"
+#include "symbol.hxx"
+
+#include <vector>
+#include <string>
+
+namespace ncc {
+  union NativeValue {
+    int integer;
+    double real;
+  };
+
+  /*
+   * Calls native code through its real C signature, so arguments travel
+   * in registers exactly as they would from compiled C.
+   */
+  typedef NativeValue (*NativeInvoker)(void* function, 
+                                       const NativeValue* arguments);
+
+  const unsigned int max_invoke_arguments = 4;
+
+  NativeInvoker get_native_invoker(ValueType ret_type,
+                                   const std::vector<ValueType>& arg_types);
+  NativeValue parse_native_value(ValueType type, const std::string& text);
+  std::string format_native_value(ValueType type, NativeValue value);
+  /* spec is name:arg1,arg2,...; returns the name */
+  std::string parse_call(FunctionTable* ft, const std::string& spec,
+                         std::vector<NativeValue>& args);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* -*- mode: C -*-
+ * Test program for lazy compilation.
+ * Only main(), used() and helper() are ever called, so only they
+ * should get machine code unless compiling eagerly. Returns 0.
+ */
+
+int helper(int x){
+  return x + 1;
+}
+int used(int x){
+  return helper(x) * 2;
+}
+int unused_a(int x){
+  return x * 3;
+}
+int unused_b(int x){
+  return unused_a(x) - 1;
+}
+int unused_c(float x){
+  return x / 2.0;
+}
+int unused_d(){
+  return unused_b(4) + unused_c(3.0);
+}
+int unused_e(int x){
+  while (x){
+    x = x - 1;
+  }
+  return x;
+}
+
+int main(){
+  return used(20) - 42;
+}
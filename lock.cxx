@@ -0,0 +1,29 @@
+#include "lock.hxx"
+
+#include <pthread.h>
+
+using namespace ncc;
+
+static pthread_once_t llvm_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t llvm_lock;
+
+static void init_llvm_lock(){
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&llvm_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+LLVMLock::LLVMLock(){
+  pthread_once(&llvm_lock_once, init_llvm_lock);
+  pthread_mutex_lock(&llvm_lock);
+}
+
+LLVMLock::~LLVMLock(){
+  pthread_mutex_unlock(&llvm_lock);
+}
+
+void LLVMLock::forked(){
+  init_llvm_lock();
+}
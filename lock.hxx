@@ -0,0 +1,28 @@
+#ifndef HXX__ncc__lock__
+#define HXX__ncc__lock__
+
+namespace ncc {
+  /*
+   * LLVM keeps its types, constants and the state of its one JIT in
+   * process-wide tables, so everything that creates or changes IR, or
+   * runs passes and the code generator, holds this lock. Sessions parse
+   * and run code in parallel, code generation takes turns. The lock is
+   * recursive.
+   *
+   * Lazy JIT stubs compile on the calling thread without it, so only a
+   * session that has the JIT to itself and runs code on one thread may
+   * be lazy. Compiler forces the others to be eager.
+   */
+  class LLVMLock {
+  public:
+    LLVMLock();
+    ~LLVMLock();
+    /* 
+     * In a child forked while holding the lock: frees it for the one
+     * thread the child has. The child must not release it otherwise.
+     */
+    static void forked();
+  };
+}
+
+#endif
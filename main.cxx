@@ -1,87 +1,581 @@
-#include "token.hxx"
-#include "parse.hxx"
-#include "AST.hxx"
-#include "symbol.hxx"
+#include "compiler.hxx"
+#include "exceptions.hxx"
+#include "profile.hxx"
+#include "specialize.hxx"
+#include "invoke.hxx"
+#include "emit.hxx"
+#include "optimize.hxx"
+#include "server.hxx"
 
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/Target/TargetOptions.h"
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "commandoptions.hxx"
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* 
+ * A program can end the process with exit() from inside run_main(),
+ * its profile is written on the way out then.
+ */
+static ncc::Profile* exit_profile = NULL;
+static std::string exit_profile_file;
+static llvm::ExecutionEngine* exit_engine = NULL;
+
+static void write_profile_at_exit(){
+  if (!exit_profile){
+    return;
+  }
+  try {
+    exit_profile->write(exit_profile_file, exit_engine);
+  } catch (std::exception* e){
+    std::cerr << "Error: " << e->what() << std::endl;
+  }
+  exit_profile = NULL;
+}
+
+static double percentile(const std::vector<double>& sorted, double p){
+  return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+static void call_function(ncc::Compiler& compiler, const std::string& spec,
+                          int repeat){
+  std::vector<ncc::NativeValue> args;
+  std::string name = ncc::parse_call(compiler.get_functions(), spec, args);
+  ncc::Function& f = compiler.get_functions()->get_function(name);
+
+  ncc::NativeInvoker invoke = ncc::get_native_invoker(f.get_ret_type(),
+                                                      f.get_arg_types());
+  void* code = compiler.get_function_pointer(name);
+  const ncc::NativeValue* a = args.empty() ? NULL : &args[0];
+  std::vector<double> samples;
+  ncc::NativeValue result;
+
+  samples.reserve(repeat);
+  for (int i = 0; i < repeat; i++){
+    double start = now_ns();
+    result = invoke(code, a);
+    samples.push_back(now_ns() - start);
+  }
+
+  std::cout << name << "() returned: " 
+            << ncc::format_native_value(f.get_ret_type(), result) 
+            << std::endl;
+
+  std::sort(samples.begin(), samples.end());
+  std::cout << "Latency over " << repeat << " calls (ns):"
+            << " min " << samples.front()
+            << " p50 " << percentile(samples, 0.5)
+            << " p90 " << percentile(samples, 0.9)
+            << " p99 " << percentile(samples, 0.99)
+            << " max " << samples.back() << std::endl;
+}
+
+static bool read_file(const std::string& name, std::string& contents){
+  std::ifstream is(name.c_str());
+  if (!is){
+    return false;
+  }
+  contents.assign(std::istreambuf_iterator<char>(is),
+                  std::istreambuf_iterator<char>());
+  return true;
+}
+
+/* code of the server needed a function it could not compile again */
+static void report_fatal_error(const std::string& message){
+  std::cerr << "Fatal Error: " << message << std::endl;
+  abort();
+}
+
+/* recompiles and reruns the file whenever it changes, until killed */
+static void watch_file(ncc::Compiler& compiler, const std::string& name,
+                       bool run, bool verbose, 
+                       const std::vector<std::string>& args){
+  struct stat last;
+  bool first = true;
+
+  for (;;){
+    struct stat st;
+    if (stat(name.c_str(), &st) != 0
+        || (!first && st.st_mtim.tv_sec == last.st_mtim.tv_sec
+            && st.st_mtim.tv_nsec == last.st_mtim.tv_nsec
+            && st.st_size == last.st_size && st.st_ino == last.st_ino)){
+      usleep(100000);
+      continue;
+    }
+    first = false;
+    last = st;
+
+    std::string source;
+    if (!read_file(name, source)){
+      continue;
+    }
+    double start = now_ns();
+    try {
+      int n = compiler.recompile(source);
+      if (verbose){
+        std::cerr << "Generated " << n << " functions in " 
+                  << (now_ns() - start) / 1e6 << " ms" << std::endl;
+      }
+      if (run){
+        int retval = compiler.run_main(args, environ);
+        std::cout << "main() returned: " << retval << std::endl; 
+      }
+    } catch (ncc::ParseError* e){
+      std::cerr << "Parse Error: " << e->what() << std::endl;
+      continue;
+    } catch (std::exception* e){
+      std::cerr << "Error: " << e->what() << std::endl;
+      continue;
+    }
+    if (verbose){
+      std::cerr << "Time to result: " << (now_ns() - start) / 1e6
+                << " ms" << std::endl;
+    }
+    std::cerr << "Watching " << name << " for changes" << std::endl;
+  }
+}
+
 int main(int argc, char**argv){
   CommandOptions co;
   std::string input_file;
+  std::vector<std::string> more_files;
+  int jobs = 1;
   bool dump_ast = false;
   bool dump_ir = false;
+  std::string emit_bc;
+  std::string emit_asm;
+  std::string emit_obj;
   bool run = false;
+  bool eager = false;
+  bool pretokenize = false;
+  bool stream = false;
+  bool watch = false;
+  bool dedup = false;
+  unsigned long code_budget = 0;
+  std::string server;
+  std::string client;
+  std::string session;
+  bool verbose = false;
+  bool whole_program = false;
+  std::string fp_model = "strict";
+  std::string mcpu = "native";
+  std::string mattr;
+  std::string profile_generate;
+  std::string profile_use;
+  ncc::Profile profile;
+  bool specialize = false;
+  unsigned int specialize_threshold = 1000;
+  ncc::Specializer specializer;
+  std::string cache_dir;
+  unsigned long cache_size = 64;
+  bool cache_stats = false;
+  ncc::CodeCache* cache = NULL;
+  std::string call;
+  int repeat = 1;
   std::vector<std::string> args;
+  ncc::CodegenOptions options;
 
   co.register_flag(dump_ast, "dump-ast", 0, "Dump AST during parsing");
   co.register_flag(dump_ir, "dump-ir", 0, "Dump compiled LLVM IR");
+  co.register_option(emit_bc, "emit-bc", 0, "Write LLVM bitcode to FILE",
+                     "FILE");
+  co.register_option(emit_asm, "emit-asm", 0, 
+                     "Write target assembly to FILE", "FILE");
+  co.register_option(emit_obj, "emit-obj", 0, 
+                     "Write a relocatable object file to FILE", "FILE");
   co.register_flag(run, "run", 0, "Run compiled code");
+  co.register_flag(eager, "eager", 0, 
+                   "Compile all functions before running instead of on "
+                   "first call");
+  co.register_option(fp_model, "fp-model", 0, 
+                     "Floating point model (strict, contract, fast)", 
+                     "MODEL");
+  co.register_option(mcpu, "mcpu", 0, 
+                     "Target CPU for the JIT (default: native)", "CPU");
+  co.register_option(mattr, "mattr", 0, 
+                     "Additional target features (e.g. +sse3,-ssse3)", 
+                     "FEATURES");
+  co.register_flag(whole_program, "whole-program", 0, 
+                   "Only main() and [[export]] functions are external");
+  co.register_option(profile_generate, "profile-generate", 0,
+                     "Instrument code and write its profile after --run",
+                     "FILE");
+  co.register_option(profile_use, "profile-use", 0,
+                     "Optimize code layout using a profile", "FILE");
+  co.register_flag(specialize, "specialize", 0,
+                   "Specialize functions for stable argument values at run time");
+  co.register_option(specialize_threshold, "specialize-threshold", 0,
+                     "Calls with the same value before specializing", "N");
+  co.register_option(cache_dir, "cache-dir", 0,
+                     "Keep compiled code in DIR across runs", "DIR");
+  co.register_option(cache_size, "cache-size", 0,
+                     "Size limit of the code cache (default: 64)", "MB");
+  co.register_flag(cache_stats, "cache-stats", 0,
+                   "Print code cache statistics");
+  co.register_option(call, "call", 0,
+                     "Call a function directly with the given arguments",
+                     "FN:ARG,...");
+  co.register_option(repeat, "repeat", 0,
+                     "Number of times --call calls the function", "N");
+  co.register_flag(verbose, "verbose", 'v', "Print what the compiler does");
+  co.register_flag(pretokenize, "pretokenize", 0,
+                   "Split the input into tokens in one pass before parsing");
+  co.register_flag(stream, "stream", 0,
+                   "Generate code while parsing, without building trees "
+                   "for function bodies");
+  co.register_flag(watch, "watch", 0,
+                   "Recompile what changed and rerun whenever the input "
+                   "file changes");
+  co.register_flag(dedup, "dedup", 0,
+                   "Let functions with the same body up to names share "
+                   "its code");
+  co.register_option(code_budget, "code-budget", 0,
+                     "Evict the code of the least recently used functions "
+                     "beyond this size, compiling them again when called; "
+                     "checked after main() returns and between --server "
+                     "requests", "KB");
+  co.register_option(server, "server", 0,
+                     "Serve compile requests on a unix socket, the input "
+                     "file is loaded into the session given by --session "
+                     "(default: \"default\")", "SOCKET");
+  co.register_option(client, "client", 0,
+                     "Have the server at SOCKET compile the input file and "
+                     "--run or --call it", "SOCKET");
+  co.register_option(session, "session", 0,
+                     "Compile server session to use, by default every "
+                     "request gets a new one", "NAME");
+  co.register_option(jobs, "jobs", 'j', 
+                     "Compile up to N input files, or parts of a large one, "
+                     "in parallel", "N");
   co.register_argument(input_file, "input-file", "Name of input file");
+  co.register_leftover_arguments(more_files, "input-files", 
+                                 "More input files, linked together");
   try {
     co.process_command_line(argc,(const char**)argv);
   } catch (CommandOptions_error &ex){
     std::cerr << "Error: " << ex.what() << std::endl;
     return 1;
   }
+  /* argv[0] of main, also when run by the server */
+  args.push_back(input_file);
 
-  std::ifstream is(input_file.c_str());
-  if (!is){
+  try {
+    options.fp_model = ncc::get_fp_model(fp_model);
+    options.whole_program = whole_program;
+    options.dedup = dedup;
+    options.code_budget = code_budget << 10;
+    if (!profile_generate.empty()){
+      profile.set_generating();
+      options.profile = &profile;
+    } else if (!profile_use.empty()){
+      profile.read(profile_use);
+      options.profile = &profile;
+    }
+  } catch (std::exception* e){
+    std::cerr << "Error: " << e->what() << std::endl;
+    return 1;
+  }
+  if (repeat < 1){
+    std::cerr << "Error: --repeat needs a positive count" << std::endl;
+    return 1;
+  }
+  if (jobs < 1){
+    std::cerr << "Error: --jobs needs a positive count" << std::endl;
+    return 1;
+  }
+  /* both keep pointers into the module of a single file */
+  if (!more_files.empty() && (specialize || !profile_generate.empty())){
+    std::cerr << "Error: --specialize and --profile-generate need a single "
+              << "input file" << std::endl;
+    return 1;
+  }
+
+  if (!server.empty() && !client.empty()){
+    std::cerr << "Error: --server and --client exclude each other" 
+              << std::endl;
+    return 1;
+  }
+  /* the specializer and the profile belong to one session */
+  if (!server.empty() && (specialize || !profile_generate.empty()
+                          || !profile_use.empty())){
+    std::cerr << "Error: --server cannot be combined with --specialize, "
+              << "--profile-generate or --profile-use" << std::endl;
+    return 1;
+  }
+  if (!client.empty()){
+    std::string source;
+    if (!more_files.empty() || !read_file(input_file, source)){
+      std::cerr << "Error: --client sends a single readable input file" 
+                << std::endl;
+      return 1;
+    }
+    ncc::Message request;
+    if (!call.empty()){
+      request.push_back("call");
+      request.push_back(session);
+      request.push_back(call);
+    } else {
+      request.push_back(run ? "run" : "compile");
+      request.push_back(session);
+    }
+    request.push_back(source);
+    if (run && call.empty()){
+      request.push_back(ncc::pack_environment(environ));
+      request.insert(request.end(), args.begin(), args.end());
+    }
+    try {
+      ncc::Message reply = ncc::call_server(client, request);
+      if (reply.size() < 2 || reply[0] != "ok"){
+        std::cerr << (reply.size() == 2 ? reply[1] : "Malformed reply") 
+                  << std::endl;
+        return 1;
+      }
+      /* what main wrote comes before how it ended, as in a local run */
+      if (reply.size() > 2){
+        std::cout << reply[2];
+      }
+      std::cout << reply[1] << std::endl;
+    } catch (std::exception* e){
+      std::cerr << "Error: " << e->what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  /* instrumented code refers to this process */
+  if ((!emit_bc.empty() || !emit_asm.empty() || !emit_obj.empty())
+      && (specialize || !profile_generate.empty())){
+    std::cerr << "Error: --emit-bc, --emit-asm and --emit-obj cannot be "
+              << "combined with --specialize or --profile-generate" 
+              << std::endl;
+    return 1;
+  }
+
+  if (dedup && stream){
+    std::cerr << "Error: --dedup cannot be combined with --stream" 
+              << std::endl;
+    return 1;
+  }
+
+  /* a resident session replaces functions one at a time */
+  if (watch && (!more_files.empty() || whole_program || specialize
+                || !profile_generate.empty())){
+    std::cerr << "Error: --watch needs a single input file and cannot be "
+              << "combined with --whole-program, --specialize or "
+              << "--profile-generate" << std::endl;
+    return 1;
+  }
+
+  if (specialize){
+    /* interprocedural passes would rewrite the watched functions */
+    if (whole_program){
+      std::cerr << "Error: --specialize cannot be combined with "
+                << "--whole-program" << std::endl;
+      return 1;
+    }
+    specializer.set_threshold(specialize_threshold);
+    if (verbose){
+      specializer.set_log(&std::cerr);
+    }
+    options.specializer = &specializer;
+  }
+
+  /* 
+   * Code generator settings are global, so functions with their own
+   * fp_model attribute only differ in what the front-end emits.
+   */
+  llvm::NoExcessFPPrecision = (options.fp_model == ncc::FP_STRICT);
+  llvm::UnsafeFPMath = (options.fp_model == ncc::FP_FAST);
+  llvm::FiniteOnlyFPMathOption = (options.fp_model == ncc::FP_FAST);
+
+  std::string source;
+  if (more_files.empty() && !read_file(input_file, source)){
     std::cerr << "Error opening input file" << std::endl;
     return 1;
   }
 
-  ncc::TopLevelForm *f;
-  ncc::SymbolTable global_symbols(new ncc::FunctionTable());
-  llvm::Module module("");
-  ncc::Tokenizer t(is);
-  ncc::Parser p(t);
+  ncc::Compiler compiler(options);
+  compiler.set_target(mcpu, mattr);
+  compiler.set_lazy(!eager);
+  compiler.set_parse_jobs(jobs);
+  compiler.set_pretokenize(pretokenize);
+  compiler.set_streaming(stream);
+  if (dump_ast){
+    compiler.set_ast_dump(&std::cerr);
+  }
+  if (verbose){
+    compiler.set_log(&std::cerr);
+  }
 
+  if (watch){
+    watch_file(compiler, input_file, run, verbose, args);
+    return 0;
+  }
 
-  while (1){
+  if (!server.empty()){
+    ncc::CompileServer compile_server(server, options, jobs);
+    compile_server.set_target(mcpu, mattr);
+    compile_server.set_fatal_error_handler(report_fatal_error);
+    if (verbose){
+      compile_server.set_log(&std::cerr);
+    }
     try {
-      f = p.read_toplevel();
+      compile_server.preload(session.empty() ? "default" : session, source);
+      compile_server.serve();
+    } catch (ncc::ParseError* e){
+      std::cerr << "Parse Error: " << e->what() << std::endl;
+      return 1;
     } catch (std::exception* e){
-      std::cerr << "Parse Error: " << t.get_line() << ":" << t.get_column() 
-                << ": " << e->what() << std::endl;
+      std::cerr << "Error: " << e->what() << std::endl;
       return 1;
     }
-    
-    if (f){
-      if (dump_ast){
-        f->print(std::cerr, 0);
-      }
-    } else {
-      break;
-    }
+    return 0;
+  }
 
+  /* instrumented code refers to this process */
+  if (!cache_dir.empty() && more_files.empty() 
+      && !specialize && profile_generate.empty()){
+    std::string salt;
+    if (!profile_use.empty()){
+      std::ifstream ps(profile_use.c_str());
+      salt.assign(std::istreambuf_iterator<char>(ps),
+                  std::istreambuf_iterator<char>());
+    }
     try {
-      f->generate(&module, &global_symbols);
+      cache = new ncc::CodeCache(cache_dir, cache_size << 20);
     } catch (std::exception* e){
       std::cerr << "Error: " << e->what() << std::endl;
       return 1;
     }
+    compiler.set_cache(cache, salt);
+  }
 
-    delete f;
+  try {
+    if (more_files.empty()){
+      compiler.compile(source);
+    } else {
+      std::vector<std::string> files;
+      files.push_back(input_file);
+      files.insert(files.end(), more_files.begin(), more_files.end());
+      compiler.compile_files(files, jobs);
+    }
+    compiler.optimize();
+    if (!profile_use.empty()){
+      int cold = profile.place_functions(compiler.get_module());
+      if (verbose){
+        std::cerr << "Moved " << cold << " functions the profiled run "
+                  << "never entered to the end" << std::endl;
+      }
+    }
+  } catch (ncc::ParseError* e){
+    std::cerr << "Parse Error: " << e->what() << std::endl;
+    return 1;
+  } catch (std::exception* e){
+    std::cerr << "Error: " << e->what() << std::endl;
+    return 1;
   }
-  
+
   if (dump_ir){
-    module.dump();
+    compiler.get_module()->dump();
+  }
+
+  try {
+    if (!emit_bc.empty()){
+      ncc::emit_bitcode(compiler.get_module(), emit_bc);
+    }
+    if (!emit_asm.empty()){
+      ncc::emit_assembly(compiler.get_module(), emit_asm, mcpu, mattr);
+    }
+    if (!emit_obj.empty()){
+      ncc::emit_object(compiler.get_module(), emit_obj, mcpu, mattr);
+    }
+  } catch (std::exception* e){
+    std::cerr << "Error: " << e->what() << std::endl;
+    return 1;
+  }
+
+  double jit_start = now_ns();
+  if (run || !call.empty()){
+    /* compiles and stores a cache entry */
+    compiler.get_engine();
   }
 
   if (run){
-    llvm::ExecutionEngine* ee = llvm::ExecutionEngine::create(&module);
-    llvm::Function* mf = module.getFunction("main");
-    int retval;
-    if (!mf){
+    if (!compiler.get_module()->getFunction("main")){
       std::cerr << "Fatal Error: No main()!" << std::endl;
       return 0;
     }
     
-    retval = ee->runFunctionAsMain(mf, args, environ);
+    if (!profile_generate.empty()){
+      exit_profile = &profile;
+      exit_profile_file = profile_generate;
+      exit_engine = compiler.get_engine();
+      atexit(write_profile_at_exit);
+    }
+    int retval = compiler.run_main(args, environ);
     std::cout << "main() returned: " << retval << std::endl; 
+    if (verbose){
+      std::cerr << "Time to result: " << (now_ns() - jit_start) / 1e6
+                << " ms" << std::endl;
+    }
+
+    if (!profile_generate.empty()){
+      /* main returned, the session is still alive to write it */
+      exit_profile = NULL;
+      try {
+        profile.write(profile_generate, compiler.get_engine());
+      } catch (std::exception* e){
+        std::cerr << "Error: " << e->what() << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (!call.empty()){
+    try {
+      call_function(compiler, call, repeat);
+    } catch (std::exception* e){
+      std::cerr << "Error: " << e->what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (verbose && dedup){
+    std::cerr << "Shared the code of " 
+              << compiler.get_functions()->get_shared_count()
+              << " functions" << std::endl;
+  }
+  if (verbose && (run || !call.empty())){
+    std::cerr << "JIT compiled " << compiler.count_compiled_functions()
+              << " of " << ncc::count_functions(compiler.get_module())
+              << " functions" << std::endl;
+  }
+  if (verbose && code_budget){
+    compiler.print_code_stats(std::cerr);
+  }
+
+  if (cache){
+    try {
+      cache->save_stats();
+    } catch (std::exception* e){
+      std::cerr << "Warning: " << e->what() << std::endl;
+    }
+    if (cache_stats){
+      cache->print_stats(std::cerr);
+    }
+    delete cache;
   }
 }
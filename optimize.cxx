@@ -0,0 +1,101 @@
+#include "optimize.hxx"
+
+#include "llvm/CallingConv.h"
+#include "llvm/Instructions.h"
+#include "llvm/PassManager.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Scalar.h"
+
+using namespace ncc;
+
+/*
+ * Internal functions that are only ever called directly get the fast
+ * calling convention, with their calls. Modules linked from several
+ * files only have them internal since the internalize pass.
+ */
+static void use_fast_calls(llvm::Module* module){
+  for (llvm::Module::iterator f = module->begin(); f != module->end(); f++){
+    if (f->isDeclaration() || !f->hasInternalLinkage() 
+        || f->getCallingConv() == llvm::CallingConv::Fast){
+      continue;
+    }
+    std::vector<llvm::CallInst*> calls;
+    bool direct = true;
+    for (llvm::Value::use_iterator u = f->use_begin(); 
+         u != f->use_end(); u++){
+      llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(*u);
+      if (!call || call->getCalledFunction() != &*f){
+        direct = false;
+        break;
+      }
+      calls.push_back(call);
+    }
+    if (!direct){
+      continue;
+    }
+    f->setCallingConv(llvm::CallingConv::Fast);
+    for (std::vector<llvm::CallInst*>::iterator i = calls.begin();
+         i != calls.end(); i++){
+      (*i)->setCallingConv(llvm::CallingConv::Fast);
+    }
+  }
+}
+
+/*
+ * Interprocedural pipeline for --whole-program. Everything but the
+ * exported functions gets internal linkage first (modules linked from
+ * several files still have all of it external), so dead code gets
+ * removed and the rest can have its arguments specialized, promoted and
+ * inlined across files. Internal functions use the fast calling
+ * convention at the end.
+ */
+void ncc::optimize_whole_program(llvm::Module* module,
+                                 const std::vector<std::string>& exports){
+  llvm::PassManager pm;
+  std::vector<const char*> export_list;
+
+  for (std::vector<std::string>::const_iterator i = exports.begin();
+       i != exports.end(); i++){
+    export_list.push_back(i->c_str());
+  }
+
+  pm.add(new llvm::TargetData(module));
+  pm.add(llvm::createInternalizePass(export_list));
+  pm.add(llvm::createGlobalOptimizerPass());
+  pm.add(llvm::createGlobalDCEPass());
+  pm.add(llvm::createIPConstantPropagationPass());
+  pm.add(llvm::createDeadArgEliminationPass());
+  pm.add(llvm::createPromoteMemoryToRegisterPass());
+  pm.add(llvm::createInstructionCombiningPass());
+  pm.add(llvm::createCFGSimplificationPass());
+  pm.add(llvm::createPruneEHPass());
+  pm.add(llvm::createFunctionInliningPass());
+  pm.add(llvm::createArgumentPromotionPass());
+  pm.add(llvm::createScalarReplAggregatesPass());
+  pm.add(llvm::createInstructionCombiningPass());
+  pm.add(llvm::createTailCallEliminationPass());
+  pm.add(llvm::createCFGSimplificationPass());
+  pm.add(llvm::createLoopRotatePass());
+  pm.add(llvm::createLICMPass());
+  pm.add(llvm::createGVNPass());
+  pm.add(llvm::createDeadStoreEliminationPass());
+  pm.add(llvm::createAggressiveDCEPass());
+  pm.add(llvm::createCFGSimplificationPass());
+  pm.add(llvm::createDeadArgEliminationPass());
+  pm.add(llvm::createGlobalDCEPass());
+  pm.add(llvm::createConstantMergePass());
+
+  pm.run(*module);
+  use_fast_calls(module);
+}
+
+int ncc::count_functions(llvm::Module* module){
+  int n = 0;
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    if (!i->isDeclaration()){
+      n++;
+    }
+  }
+  return n;
+}
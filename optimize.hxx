@@ -0,0 +1,15 @@
+#ifndef HXX__ncc__optimize__
+#define HXX__ncc__optimize__
+
+#include "llvm/Module.h"
+
+#include <string>
+#include <vector>
+
+namespace ncc {
+  void optimize_whole_program(llvm::Module* module,
+                              const std::vector<std::string>& exports);
+  int count_functions(llvm::Module* module);
+}
+
+#endif
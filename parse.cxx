@@ -17,12 +17,57 @@ ValueType Parser::parse_type(){
   }
 }
 
-FunctionDeclaration* Parser::parse_function(ValueType return_type, const std::string& name){
+AttributeVector Parser::parse_attributes(){
+  AttributeVector attributes;
+  std::string name;
+  std::vector<std::string> arguments;
+
+  tok.eat_token('[');
+  tok.eat_token('[');
+  for(;;) {
+    if (tok.current_token() != TOKEN_IDENT){
+      throw new ExpectedToken(TOKEN_IDENT, tok.current_token());
+    }
+    name = tok.get_text();
+    arguments.clear();
+    tok.next_token();
+    if (tok.current_token() == '('){
+      tok.next_token();
+      if (tok.current_token() != ')'){
+        for(;;) {
+          if (tok.current_token() != TOKEN_STRING && 
+              tok.current_token() != TOKEN_IDENT){
+            throw new UnexpectedToken(tok.current_token());
+          }
+          arguments.push_back(tok.get_text());
+          tok.next_token();
+          if (tok.current_token() == ')'){
+            break;
+          }
+          tok.eat_token(',');
+        }
+      }
+      tok.next_token();
+    }
+    attributes.push_back(new Attribute(name, arguments));
+    if (tok.current_token() == ']'){
+      break;
+    }
+    tok.eat_token(',');
+  }
+  tok.eat_token(']');
+  tok.eat_token(']');
+  return attributes;
+}
+
+FunctionDeclaration* Parser::parse_function(ValueType return_type, const std::string& name,
+                                            const AttributeVector& attributes){
   ArgumentVector arguments;
   ValueType a_type;
   Block* b;
   std::string a_name;
   FunctionDeclaration* r;
+  FunctionDefinition* d;
 
   tok.next_token();
   if (tok.current_token() != ')'){
@@ -42,12 +87,18 @@ FunctionDeclaration* Parser::parse_function(ValueType return_type, const std::st
   tok.next_token();
   switch (tok.current_token()){
   case ';':
-    r = new FunctionDeclaration(return_type, name, arguments);
+    r = new FunctionDeclaration(return_type, name, arguments, attributes);
     tok.next_token();
     return r;
   case '{':
+    if (module){
+      d = new FunctionDefinition(return_type, name, arguments, attributes, 
+                                 NULL);
+      stream_body(d);
+      return d;
+    }
     b = parse_block();
-    return new FunctionDefinition(return_type, name, arguments, b);
+    return new FunctionDefinition(return_type, name, arguments, attributes, b);
   default:
     throw new UnexpectedToken(tok.current_token());
   }
@@ -277,7 +328,7 @@ Expression* Parser::parse_assign(){
   if (tok.current_token() == '='){
     VariableReference* n = dynamic_cast<VariableReference*>(r);
     if (!n){
-      throw "l-value expected";
+      throw new ExpectedLValue();
     }
     tok.next_token();
     v = parse_assign();
@@ -318,6 +369,40 @@ Block* Parser::parse_block(){
   return new Block(v); 
 }
 
+/*
+ * Only one statement of the body exists as a tree at any time, it is
+ * generated and freed before the next one is parsed.
+ */
+void Parser::stream_body(FunctionDefinition* d){
+  FunctionBody* body = NULL;
+  Statement* s = NULL;
+
+  try {
+    body = d->generate_prolog(module, symbols);
+    tok.eat_token('{');
+    while (tok.current_token() != '}'){
+      if (tok.current_token() == ';'){
+        tok.next_token();
+        continue;
+      }
+      s = parse_statement();
+      body->generate(s);
+      delete s;
+      s = NULL;
+    }
+    tok.eat_token('}');
+  } catch (std::exception* e){
+    delete s;
+    if (body){
+      /* leaves no half generated function behind */
+      d->discard_body(body, symbols);
+    }
+    delete d;
+    throw;
+  }
+  d->generate_epilog(body);
+}
+
 ConditionalStatement* Parser::parse_condition(){
   Expression* cond;
   Statement* cons;
@@ -392,21 +477,28 @@ Statement* Parser::parse_statement(){
 TopLevelForm* Parser::read_toplevel(){
   ValueType type;
   std::string ident;
+  AttributeVector attributes;
   TopLevelForm* r;
   if (tok.current_token() == TOKEN_EOF){
     return NULL;
   }
+  if (tok.current_token() == '['){
+    attributes = parse_attributes();
+  }
   type = parse_type();
   tok.next_token_expect(TOKEN_IDENT);
   ident = tok.get_text();
   tok.next_token();
+  if (!attributes.empty() && tok.current_token() != '('){
+    throw new FeatureNotImplemented("attributes on global variables");
+  }
   switch (tok.current_token()){
   case ';':
     r = new GlobalVariable(type, ident, NULL);
     tok.next_token();
     break;
   case '(':
-    r = parse_function(type, ident);
+    r = parse_function(type, ident, attributes);
     break;
   case '=':
     r = new GlobalVariable(type, ident, parse_initializer());
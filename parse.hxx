@@ -5,8 +5,12 @@ namespace ncc{
   class Parser {
   protected:
     Tokenizer& tok;
+    llvm::Module* module;
+    SymbolTable* symbols;
     ValueType parse_type();
-    FunctionDeclaration* parse_function(ValueType return_type, const std::string& name);
+    AttributeVector parse_attributes();
+    FunctionDeclaration* parse_function(ValueType return_type, const std::string& name,
+                                        const AttributeVector& attributes);
     Expression* parse_initializer();
     Expression* parse_funcall(const std::string& ident);
     Expression* parse_value();
@@ -20,15 +24,25 @@ namespace ncc{
     Expression* parse_assign();
     Expression* parse_comma();
     Block* parse_block();
+    void stream_body(FunctionDefinition* d);
     ConditionalStatement* parse_condition();
     WhileStatement* parse_while();
     Statement* parse_statement();
     LocalVariable* parse_local_variable();
 
   public:
-    Parser(Tokenizer& tok) : tok(tok) {
+    Parser(Tokenizer& tok) : tok(tok), module(NULL), symbols(NULL) {
       tok.next_token();
     };
+    /*
+     * Generate function bodies into module statement by statement while
+     * parsing them instead of building their trees. The caller has to
+     * generate every other form before reading the next one.
+     */
+    void set_streaming(llvm::Module* module, SymbolTable* symbols){
+      this->module = module;
+      this->symbols = symbols;
+    }
     TopLevelForm* read_toplevel();
   };
 }
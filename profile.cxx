@@ -0,0 +1,172 @@
+#include "profile.hxx"
+#include "exceptions.hxx"
+#include "lock.hxx"
+
+#include <fstream>
+#include <cstdio>
+
+using namespace ncc;
+
+void Profile::count(llvm::LLVMBuilder& builder, llvm::Value* amount){
+  llvm::Module* module = builder.GetInsertBlock()->getParent()->getParent();
+  Counter c;
+  char name[32];
+
+  c.function = function;
+  c.index = next_index;
+  snprintf(name, sizeof(name), ".%d", next_index);
+  next_index++;
+
+  /* external, so that optimization cannot drop the never read counters */
+  c.address = 
+    new llvm::GlobalVariable(llvm::Type::Int64Ty,
+                             false,
+                             llvm::GlobalValue::ExternalLinkage,
+                             llvm::ConstantInt::get(llvm::Type::Int64Ty, 0),
+                             "ncc.prof." + function + name,
+                             module);
+  counters.push_back(c);
+
+  llvm::Value* v = builder.CreateLoad(c.address, "prof");
+  v = builder.CreateAdd(v, amount, "prof");
+  builder.CreateStore(v, c.address);
+}
+
+uint64_t Profile::get_count(int index){
+  std::map<std::string, std::vector<uint64_t> >::iterator i = 
+    counts.find(function);
+  if (i == counts.end() || index >= (int)i->second.size()){
+    return 0;
+  }
+  return i->second[index];
+}
+
+void Profile::begin_function(llvm::Function* f, llvm::LLVMBuilder& builder){
+  function = f->getName();
+  next_index = 0;
+  cold_blocks.clear();
+  if (generating){
+    count(builder, llvm::ConstantInt::get(llvm::Type::Int64Ty, 1));
+  } else {
+    next_index++;
+  }
+}
+
+void Profile::end_function(llvm::Function* f){
+  for (std::vector<llvm::BasicBlock*>::iterator i = cold_blocks.begin();
+       i != cold_blocks.end(); i++){
+    (*i)->moveAfter(&f->back());
+  }
+  cold_blocks.clear();
+}
+
+/*
+ * on_true or on_false may be NULL when the successor is a join point
+ * that should stay where it is.
+ */
+void Profile::branch(llvm::LLVMBuilder& builder, llvm::Value* cond,
+                     llvm::BasicBlock* on_true, llvm::BasicBlock* on_false){
+  if (generating){
+    count(builder, llvm::ConstantInt::get(llvm::Type::Int64Ty, 1));
+    count(builder, builder.CreateZExt(cond, llvm::Type::Int64Ty, "prof"));
+    return;
+  }
+
+  uint64_t total = get_count(next_index++);
+  uint64_t taken = get_count(next_index++);
+  if (total == 0 || taken > total){
+    return;
+  }
+  if (taken < total - taken){
+    if (on_true){
+      cold_blocks.push_back(on_true);
+    }
+  } else if (taken > total - taken){
+    if (on_false){
+      cold_blocks.push_back(on_false);
+    }
+  }
+}
+
+/*
+ * Moves the functions with an entry count of 0 to the end of module,
+ * in their order, and returns how many there were. Functions the
+ * profile does not know stay where they are. Only emitted code is laid
+ * out in module order, the JIT places functions as it compiles them.
+ */
+int Profile::place_functions(llvm::Module* module){
+  LLVMLock lock;
+  std::vector<llvm::Function*> cold;
+
+  for (llvm::Module::iterator i = module->begin(); i != module->end(); i++){
+    std::map<std::string, std::vector<uint64_t> >::iterator c = 
+      counts.find(i->getName());
+    if (!i->isDeclaration() && c != counts.end() && !c->second.empty()
+        && c->second[0] == 0){
+      cold.push_back(&*i);
+    }
+  }
+  for (std::vector<llvm::Function*>::iterator i = cold.begin();
+       i != cold.end(); i++){
+    (*i)->removeFromParent();
+    module->getFunctionList().push_back(*i);
+  }
+  return cold.size();
+}
+
+/*
+ * The profile file lists every function that has counters:
+ *
+ *   function <name> <number of counters>
+ *   <count> <count> ...
+ */
+void Profile::read(const std::string& filename){
+  std::ifstream is(filename.c_str());
+  std::string keyword;
+  std::string name;
+  int n;
+
+  if (!is){
+    throw new ProfileError("cannot open " + filename);
+  }
+  while (is >> keyword){
+    if (keyword != "function" || !(is >> name >> n) || n < 0){
+      throw new ProfileError("malformed profile " + filename);
+    }
+    std::vector<uint64_t>& v = counts[name];
+    v.resize(n);
+    for (int i = 0; i < n; i++){
+      if (!(is >> v[i])){
+        throw new ProfileError("malformed profile " + filename);
+      }
+    }
+  }
+}
+
+void Profile::write(const std::string& filename, llvm::ExecutionEngine* ee){
+  LLVMLock lock;
+  std::map<std::string, std::vector<uint64_t> > result;
+  std::ofstream os(filename.c_str());
+
+  if (!os){
+    throw new ProfileError("cannot write " + filename);
+  }
+  for (std::vector<Counter>::iterator i = counters.begin();
+       i != counters.end(); i++){
+    std::vector<uint64_t>& v = result[i->function];
+    if ((int)v.size() <= i->index){
+      v.resize(i->index + 1);
+    }
+    v[i->index] = *(uint64_t*)ee->getPointerToGlobal(i->address);
+  }
+  for (std::map<std::string, std::vector<uint64_t> >::iterator i = 
+         result.begin();
+       i != result.end(); i++){
+    os << "function " << i->first << " " << i->second.size() << std::endl;
+    for (std::vector<uint64_t>::iterator j = i->second.begin();
+         j != i->second.end(); j++){
+      os << (j == i->second.begin() ? "" : " ") << *j;
+    }
+    os << std::endl;
+  }
+}
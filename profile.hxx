@@ -0,0 +1,62 @@
+#ifndef HXX__ncc__profile__
+#define HXX__ncc__profile__
+
+#include "llvm/DerivedTypes.h"
+#include "llvm/Module.h"
+#include "llvm/Support/LLVMBuilder.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+namespace ncc {
+  /*
+   * Edge profile of the compiled program. Every function has a counter
+   * for its entry and two for each conditional branch (times executed,
+   * times the condition was true), numbered in code generation order.
+   *
+   * In generate mode the counters are emitted into the code and written
+   * to a file after the run, in use mode a previously written file is
+   * read back and the colder successor of each branch is moved to the
+   * end of the function, so the hot path is laid out straight. The
+   * same goes for functions the run never entered, which end up behind
+   * the rest of the module.
+   */
+  class Profile {
+  protected:
+    struct Counter {
+      std::string function;
+      int index;
+      llvm::GlobalVariable* address;
+    };
+    bool generating;
+    std::vector<Counter> counters;
+    std::map<std::string, std::vector<uint64_t> > counts;
+    std::string function;
+    int next_index;
+    std::vector<llvm::BasicBlock*> cold_blocks;
+
+    void count(llvm::LLVMBuilder& builder, llvm::Value* amount);
+    uint64_t get_count(int index);
+  public:
+    Profile() : generating(false), next_index(0) {}
+    void set_generating(){
+      generating = true;
+    }
+    bool is_generating(){
+      return generating;
+    }
+    void read(const std::string& filename);
+    void write(const std::string& filename, llvm::ExecutionEngine* ee);
+
+    void begin_function(llvm::Function* f, llvm::LLVMBuilder& builder);
+    void end_function(llvm::Function* f);
+    void branch(llvm::LLVMBuilder& builder, llvm::Value* cond,
+                llvm::BasicBlock* on_true, llvm::BasicBlock* on_false);
+    int place_functions(llvm::Module* module);
+  };
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HXX__ncc__queue__
+#define HXX__ncc__queue__
+
+#include <pthread.h>
+
+namespace ncc {
+  /*
+   * Bounded ring between a producer and a consumer thread. A side that
+   * finds the ring full or empty sleeps until the other side has made
+   * room or added an item. N must be a power of two.
+   */
+  template <typename T, unsigned int N>
+  class BoundedQueue {
+  protected:
+    T items[N];
+    unsigned int head;
+    unsigned int tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+  public:
+    BoundedQueue() : head(0), tail(0) {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&not_full, NULL);
+      pthread_cond_init(&not_empty, NULL);
+    }
+    ~BoundedQueue(){
+      pthread_cond_destroy(&not_empty);
+      pthread_cond_destroy(&not_full);
+      pthread_mutex_destroy(&mutex);
+    }
+
+    void push(const T& item){
+      pthread_mutex_lock(&mutex);
+      while (tail - head == N){
+        pthread_cond_wait(&not_full, &mutex);
+      }
+      items[tail++ % N] = item;
+      pthread_cond_signal(&not_empty);
+      pthread_mutex_unlock(&mutex);
+    }
+    T pop(){
+      T item;
+      pthread_mutex_lock(&mutex);
+      while (tail == head){
+        pthread_cond_wait(&not_empty, &mutex);
+      }
+      item = items[head++ % N];
+      pthread_cond_signal(&not_full);
+      pthread_mutex_unlock(&mutex);
+      return item;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "scan.hxx"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace ncc;
+
+static inline bool is_space(char ch){
+  return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+}
+
+static inline bool is_identifier(char ch){
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') 
+    || (ch >= '0' && ch <= '9') || ch == '_' || ch == '$';
+}
+
+static inline bool is_number(char ch){
+  return (ch >= '0' && ch <= '9') || ch == '.';
+}
+
+#ifdef __SSE2__
+static inline __m128i load(const char* p){
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline __m128i equal(__m128i v, char ch){
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(ch));
+}
+
+/* bytes with lo <= v <= hi, compared unsigned */
+static inline __m128i in_range(__m128i v, char lo, char hi){
+  __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8(hi - lo)),
+                        _mm_setzero_si128());
+}
+
+static inline unsigned int mask(__m128i v){
+  return _mm_movemask_epi8(v);
+}
+
+static inline __m128i space_mask(__m128i v){
+  return _mm_or_si128(_mm_or_si128(equal(v, ' '), equal(v, '\n')),
+                      _mm_or_si128(equal(v, '\t'), equal(v, '\r')));
+}
+
+static inline __m128i identifier_mask(__m128i v){
+  __m128i m = _mm_or_si128(in_range(v, 'a', 'z'), in_range(v, 'A', 'Z'));
+  m = _mm_or_si128(m, in_range(v, '0', '9'));
+  return _mm_or_si128(m, _mm_or_si128(equal(v, '_'), equal(v, '$')));
+}
+
+static inline __m128i number_mask(__m128i v){
+  return _mm_or_si128(in_range(v, '0', '9'), equal(v, '.'));
+}
+#endif
+
+size_t ncc::scan_whitespace(const char* s, size_t n, size_t i){
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16){
+    unsigned int m = ~mask(space_mask(load(s + i))) & 0xffff;
+    if (m){
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  while (i < n && is_space(s[i])){
+    i++;
+  }
+  return i;
+}
+
+size_t ncc::scan_line_end(const char* s, size_t n, size_t i){
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16){
+    __m128i v = load(s + i);
+    unsigned int m = mask(_mm_or_si128(equal(v, '\n'), equal(v, '\r')));
+    if (m){
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  while (i < n && s[i] != '\n' && s[i] != '\r'){
+    i++;
+  }
+  return i;
+}
+
+/* index of the '*' of the closing star-slash */
+size_t ncc::scan_comment_end(const char* s, size_t n, size_t i){
+#ifdef __SSE2__
+  /* a '*' at the end of one block pairs with the next one */
+  for (; i + 17 <= n; i += 16){
+    unsigned int m = mask(equal(load(s + i), '*')) 
+      & mask(equal(load(s + i + 1), '/'));
+    if (m){
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  for (; i + 1 < n; i++){
+    if (s[i] == '*' && s[i + 1] == '/'){
+      return i;
+    }
+  }
+  return n;
+}
+
+size_t ncc::scan_identifier(const char* s, size_t n, size_t i){
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16){
+    unsigned int m = ~mask(identifier_mask(load(s + i))) & 0xffff;
+    if (m){
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  while (i < n && is_identifier(s[i])){
+    i++;
+  }
+  return i;
+}
+
+size_t ncc::scan_number(const char* s, size_t n, size_t i){
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16){
+    unsigned int m = ~mask(number_mask(load(s + i))) & 0xffff;
+    if (m){
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  while (i < n && is_number(s[i])){
+    i++;
+  }
+  return i;
+}
+
+/* offsets where each line after the first starts */
+void ncc::scan_lines(const char* s, size_t n, 
+                     std::vector<size_t>& line_starts){
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16){
+    unsigned int m = mask(equal(load(s + i), '\n'));
+    while (m){
+      line_starts.push_back(i + __builtin_ctz(m) + 1);
+      m &= m - 1;
+    }
+  }
+#endif
+  for (; i < n; i++){
+    if (s[i] == '\n'){
+      line_starts.push_back(i + 1);
+    }
+  }
+}
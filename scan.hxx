@@ -0,0 +1,21 @@
+#ifndef HXX__ncc__scan__
+#define HXX__ncc__scan__
+
+#include <vector>
+#include <cstddef>
+
+namespace ncc {
+  /*
+   * Character class scans over a source buffer, 16 bytes at a time
+   * with SSE2 where the compiler targets it. Each returns the index of
+   * the first byte at or after i that ends the run, or n.
+   */
+  size_t scan_whitespace(const char* s, size_t n, size_t i);
+  size_t scan_line_end(const char* s, size_t n, size_t i);
+  size_t scan_comment_end(const char* s, size_t n, size_t i);
+  size_t scan_identifier(const char* s, size_t n, size_t i);
+  size_t scan_number(const char* s, size_t n, size_t i);
+  void scan_lines(const char* s, size_t n, std::vector<size_t>& line_starts);
+}
+
+#endif
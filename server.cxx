@@ -0,0 +1,457 @@
+#include "server.hxx"
+#include "exceptions.hxx"
+#include "invoke.hxx"
+
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+using namespace ncc;
+
+/* larger messages are taken as garbage */
+static const unsigned int max_strings = 64;
+static const unsigned int max_length = 64 << 20;
+
+static bool read_all(int fd, char* buffer, size_t length){
+  while (length > 0){
+    ssize_t n = read(fd, buffer, length);
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      return false;
+    }
+    buffer += n;
+    length -= n;
+  }
+  return true;
+}
+
+static void write_all(int fd, const char* buffer, size_t length){
+  while (length > 0){
+    ssize_t n = write(fd, buffer, length);
+    if (n < 0 && errno == EINTR){
+      continue;
+    }
+    if (n <= 0){
+      throw new ServerError(std::string("write failed: ") + strerror(errno));
+    }
+    buffer += n;
+    length -= n;
+  }
+}
+
+static void put_number(std::string& buffer, uint32_t n){
+  n = htonl(n);
+  buffer.append((const char*)&n, sizeof(n));
+}
+
+static bool get_number(int fd, uint32_t& n){
+  if (!read_all(fd, (char*)&n, sizeof(n))){
+    return false;
+  }
+  n = ntohl(n);
+  return true;
+}
+
+void ncc::send_message(int fd, const Message& message){
+  std::string buffer;
+  put_number(buffer, message.size());
+  for (Message::const_iterator i = message.begin(); i != message.end(); i++){
+    put_number(buffer, i->size());
+    buffer += *i;
+  }
+  write_all(fd, buffer.data(), buffer.size());
+}
+
+bool ncc::receive_message(int fd, Message& message){
+  uint32_t count;
+  message.clear();
+  if (!get_number(fd, count)){
+    return false;
+  }
+  if (count > max_strings){
+    throw new ServerError("malformed message");
+  }
+  for (uint32_t i = 0; i < count; i++){
+    uint32_t length;
+    if (!get_number(fd, length)){
+      throw new ServerError("truncated message");
+    }
+    if (length > max_length){
+      throw new ServerError("malformed message");
+    }
+    std::string s(length, '\0');
+    if (length > 0 && !read_all(fd, &s[0], length)){
+      throw new ServerError("truncated message");
+    }
+    message.push_back(s);
+  }
+  return true;
+}
+
+static void socket_address(const std::string& path, struct sockaddr_un& a){
+  if (path.size() >= sizeof(a.sun_path)){
+    throw new ServerError("socket path too long: " + path);
+  }
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  strcpy(a.sun_path, path.c_str());
+}
+
+std::string ncc::pack_environment(const char* const* envp){
+  std::string environment;
+  for (; *envp; envp++){
+    environment.append(*envp);
+    environment.push_back('\0');
+  }
+  return environment;
+}
+
+Message ncc::call_server(const std::string& path, const Message& request){
+  struct sockaddr_un a;
+  Message reply;
+  int fd;
+
+  socket_address(path, a);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0){
+    throw new ServerError(std::string("socket: ") + strerror(errno));
+  }
+  if (connect(fd, (struct sockaddr*)&a, sizeof(a)) != 0){
+    close(fd);
+    throw new ServerError("cannot connect to " + path + ": "
+                          + strerror(errno));
+  }
+  try {
+    send_message(fd, request);
+    if (!receive_message(fd, reply)){
+      throw new ServerError("connection closed");
+    }
+  } catch (ServerError* e){
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return reply;
+}
+
+/* a compiler session and the requests using it */
+struct ncc::ServerSession {
+  Compiler* compiler;
+  int users;
+  bool closed;
+};
+
+CompileServer::CompileServer(const std::string& path,
+                             const CodegenOptions& options,
+                             int workers) : path(path),
+                                            options(options),
+                                            cpu("native"),
+                                            workers(workers),
+                                            log(NULL),
+                                            fatal_error(NULL){
+  /* they would follow whichever session got its engine last */
+  if (options.specializer || options.profile){
+    throw new ServerError("sessions cannot share a specializer or a "
+                          "profile");
+  }
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+}
+
+CompileServer::~CompileServer(){
+  for (std::map<std::string, ServerSession*>::iterator i = sessions.begin();
+       i != sessions.end(); i++){
+    delete i->second->compiler;
+    delete i->second;
+  }
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+}
+
+ServerSession* CompileServer::open_session(const std::string& name){
+  ServerSession* s = NULL;
+
+  pthread_mutex_lock(&mutex);
+  if (!name.empty() && sessions.count(name)){
+    s = sessions[name];
+  } else {
+    s = new ServerSession;
+    s->compiler = new Compiler(options);
+    s->compiler->set_target(cpu, attrs);
+    /* requests on other threads run the code of the session */
+    s->compiler->set_lazy(false);
+    /* only trim_session() knows when no request runs its code */
+    s->compiler->set_auto_trim(false);
+    s->compiler->set_fatal_error_handler(fatal_error);
+    s->users = 0;
+    s->closed = name.empty();
+    if (!name.empty()){
+      sessions[name] = s;
+    }
+  }
+  s->users++;
+  pthread_mutex_unlock(&mutex);
+  return s;
+}
+
+void CompileServer::release_session(ServerSession* s){
+  bool unused;
+
+  pthread_mutex_lock(&mutex);
+  unused = (--s->users == 0) && s->closed;
+  pthread_mutex_unlock(&mutex);
+  if (unused){
+    delete s->compiler;
+    delete s;
+  }
+}
+
+/* 
+ * Evicting code needs a point where none of it runs, so only the last
+ * request using the session does it, keeping new ones out meanwhile.
+ */
+void CompileServer::trim_session(ServerSession* s){
+  pthread_mutex_lock(&mutex);
+  try {
+    if (s->users == 1 && s->compiler->trim_code() && log){
+      s->compiler->print_code_stats(*log);
+    }
+  } catch (std::exception* e){
+    pthread_mutex_unlock(&mutex);
+    throw;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/* requests still using the session finish first */
+void CompileServer::close_session(const std::string& name){
+  std::map<std::string, ServerSession*>::iterator i;
+  ServerSession* s = NULL;
+
+  pthread_mutex_lock(&mutex);
+  i = sessions.find(name);
+  if (i != sessions.end()){
+    s = i->second;
+    sessions.erase(i);
+    s->closed = true;
+    s->users++;
+  }
+  pthread_mutex_unlock(&mutex);
+  if (!s){
+    throw new ServerError("no session " + name);
+  }
+  release_session(s);
+}
+
+void CompileServer::preload(const std::string& name,
+                            const std::string& source){
+  ServerSession* s = open_session(name);
+  try {
+    s->compiler->compile(source);
+  } catch (std::exception* e){
+    release_session(s);
+    throw;
+  }
+  release_session(s);
+}
+
+static std::string call_function(Compiler* compiler, const std::string& spec){
+  std::vector<NativeValue> args;
+  std::string name = parse_call(compiler->get_functions(), spec, args);
+  Function& f = compiler->get_functions()->get_function(name);
+  NativeInvoker invoke = get_native_invoker(f.get_ret_type(),
+                                            f.get_arg_types());
+  void* code = compiler->get_function_pointer(name);
+  NativeValue result = invoke(code, args.empty() ? NULL : &args[0]);
+  return name + "() returned: "
+    + format_native_value(f.get_ret_type(), result);
+}
+
+/* main gets the arguments and environment of the client */
+static void run_main(Compiler* compiler, const Message& request, 
+                     Message& reply){
+  std::vector<std::string> args(request.begin() + 4, request.end());
+  std::vector<const char*> envp;
+  const std::string& environment = request[3];
+  std::string output;
+  size_t begin = 0;
+  size_t end;
+
+  while ((end = environment.find('\0', begin)) != std::string::npos){
+    envp.push_back(environment.c_str() + begin);
+    begin = end + 1;
+  }
+  envp.push_back(NULL);
+  std::string result = compiler->run_main_forked(args, &envp[0], &output);
+  reply.push_back("ok");
+  reply.push_back(result);
+  reply.push_back(output);
+}
+
+Message CompileServer::handle(const Message& request){
+  Message reply;
+  std::string command = request.empty() ? "" : request[0];
+  size_t source_index = (command == "call") ? 3 : 2;
+
+  if (command != "compile" && command != "run" && command != "call"
+      && command != "close"){
+    reply.push_back("error");
+    reply.push_back("unknown request " + command);
+    return reply;
+  }
+  if (command == "run" ? request.size() < 4 
+      : request.size() != (command == "close" ? 2 : source_index + 1)){
+    reply.push_back("error");
+    reply.push_back("wrong number of arguments for " + command);
+    return reply;
+  }
+
+  if (command == "close"){
+    try {
+      close_session(request[1]);
+      reply.push_back("ok");
+      reply.push_back("closed " + request[1]);
+    } catch (std::exception* e){
+      reply.push_back("error");
+      reply.push_back(e->what());
+    }
+    return reply;
+  }
+
+  ServerSession* s = open_session(request[1]);
+  try {
+    Compiler* compiler = s->compiler;
+    if (!request[source_index].empty()){
+      compiler->compile(request[source_index]);
+    }
+    if (command == "run"){
+      run_main(compiler, request, reply);
+    } else if (command == "call"){
+      reply.push_back("ok");
+      reply.push_back(call_function(compiler, request[2]));
+    } else {
+      reply.push_back("ok");
+      reply.push_back("compiled");
+    }
+    trim_session(s);
+  } catch (ParseError* e){
+    reply.clear();
+    reply.push_back("error");
+    reply.push_back(std::string("Parse Error: ") + e->what());
+  } catch (std::exception* e){
+    reply.clear();
+    reply.push_back("error");
+    reply.push_back(std::string("Error: ") + e->what());
+  } catch (...){
+    reply.clear();
+    reply.push_back("error");
+    reply.push_back("Error: unexpected exception");
+  }
+  release_session(s);
+  return reply;
+}
+
+void CompileServer::serve_connection(int fd){
+  Message request;
+  try {
+    while (receive_message(fd, request)){
+      send_message(fd, handle(request));
+    }
+  } catch (ServerError* e){
+    if (log){
+      *log << e->what() << std::endl;
+    }
+  }
+  close(fd);
+}
+
+void* CompileServer::worker(void* arg){
+  CompileServer* server = (CompileServer*)arg;
+  for (;;){
+    int fd;
+    pthread_mutex_lock(&server->mutex);
+    while (server->connections.empty()){
+      pthread_cond_wait(&server->ready, &server->mutex);
+    }
+    fd = server->connections.front();
+    server->connections.pop_front();
+    pthread_mutex_unlock(&server->mutex);
+    server->serve_connection(fd);
+  }
+  return NULL;
+}
+
+/* a socket file left behind by a server that is gone can be replaced */
+static bool stale_socket(const struct sockaddr_un& a){
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  bool stale = (fd >= 0
+                && connect(fd, (struct sockaddr*)&a, sizeof(a)) != 0
+                && errno == ECONNREFUSED);
+  if (fd >= 0){
+    close(fd);
+  }
+  return stale;
+}
+
+void CompileServer::serve(){
+  struct sockaddr_un a;
+  int listener;
+
+  /* clients that go away must not end the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  socket_address(path, a);
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0){
+    throw new ServerError(std::string("socket: ") + strerror(errno));
+  }
+  if (bind(listener, (struct sockaddr*)&a, sizeof(a)) != 0){
+    if (errno != EADDRINUSE || !stale_socket(a)
+        || unlink(path.c_str()) != 0
+        || bind(listener, (struct sockaddr*)&a, sizeof(a)) != 0){
+      close(listener);
+      throw new ServerError("cannot listen on " + path + ": "
+                            + strerror(errno));
+    }
+  }
+  if (listen(listener, 64) != 0){
+    close(listener);
+    throw new ServerError(std::string("listen: ") + strerror(errno));
+  }
+
+  for (int i = 0; i < workers; i++){
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, this) != 0){
+      close(listener);
+      throw new ServerError("cannot start worker thread");
+    }
+    pthread_detach(t);
+  }
+  if (log){
+    *log << "Serving on " << path << " with " << workers << " workers"
+         << std::endl;
+  }
+
+  for (;;){
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0){
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      close(listener);
+      throw new ServerError(std::string("accept: ") + strerror(errno));
+    }
+    pthread_mutex_lock(&mutex);
+    connections.push_back(fd);
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&mutex);
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef HXX__ncc__server__
+#define HXX__ncc__server__
+
+#include "compiler.hxx"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <pthread.h>
+
+namespace ncc {
+  /*
+   * Client and server exchange lists of strings. A message is sent as
+   * a 32 bit count followed by the strings, each as a 32 bit length and
+   * its bytes, all numbers in network byte order.
+   */
+  typedef std::vector<std::string> Message;
+
+  void send_message(int fd, const Message& message);
+  /* false at the end of the stream */
+  bool receive_message(int fd, Message& message);
+  /* an environment as one string, every entry ends in a NUL */
+  std::string pack_environment(const char* const* envp);
+  /* one request on its own connection */
+  Message call_server(const std::string& path, const Message& request);
+
+  struct ServerSession;
+
+  /*
+   * Serves compile requests of local clients on a unix socket, so that
+   * starting the process and the JIT is paid once. Requests are
+   *
+   *   compile SESSION SOURCE
+   *   run SESSION SOURCE ENVIRONMENT ARG...
+   *   call SESSION NAME:ARG,... SOURCE
+   *   close SESSION
+   *
+   * where SOURCE is added to the session first. Named sessions stay
+   * until closed, the empty name stands for a new session that only
+   * lives for the request. Replies are "ok" or "error" and a text.
+   * main runs in a child process, so that exit() or a crash does not
+   * end the server, with the arguments and the environment (see
+   * pack_environment) of the client. The reply to run also has what
+   * main wrote to stdout and stderr. Functions run by call run in the
+   * server and must return.
+   */
+  class CompileServer {
+  protected:
+    std::string path;
+    CodegenOptions options;
+    std::string cpu;
+    std::string attrs;
+    int workers;
+    std::ostream* log;
+    FatalErrorHandler fatal_error;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    std::deque<int> connections;
+    std::map<std::string, ServerSession*> sessions;
+
+    ServerSession* open_session(const std::string& name);
+    void release_session(ServerSession* session);
+    void close_session(const std::string& name);
+    void trim_session(ServerSession* session);
+    Message handle(const Message& request);
+    void serve_connection(int fd);
+    static void* worker(void* arg);
+  public:
+    CompileServer(const std::string& path, const CodegenOptions& options,
+                  int workers);
+    ~CompileServer();
+
+    void set_target(const std::string& cpu, const std::string& attrs){
+      this->cpu = cpu;
+      this->attrs = attrs;
+    }
+    void set_log(std::ostream* stream){
+      log = stream;
+    }
+    /* for sessions with a code budget */
+    void set_fatal_error_handler(FatalErrorHandler handler){
+      fatal_error = handler;
+    }
+    /* adds source to a named session before serving */
+    void preload(const std::string& name, const std::string& source);
+    /* does not return unless the socket cannot be set up */
+    void serve();
+  };
+}
+
+#endif
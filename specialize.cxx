@@ -0,0 +1,358 @@
+#include "specialize.hxx"
+#include "lock.hxx"
+
+#include "llvm/Instructions.h"
+#include "llvm/ModuleProvider.h"
+#include "llvm/PassManager.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <sstream>
+#include <set>
+
+using namespace ncc;
+
+llvm::Function* Specializer::get_hook(llvm::Module* module){
+  llvm::Function* f = module->getFunction("ncc_value_profile");
+  if (f){
+    return f;
+  }
+  std::vector<const llvm::Type*> arg_types;
+  arg_types.push_back(llvm::PointerType::getUnqual(llvm::Type::Int8Ty));
+  arg_types.push_back(llvm::Type::Int32Ty);
+  arg_types.push_back(llvm::Type::Int32Ty);
+  arg_types.push_back(llvm::Type::Int32Ty);
+  llvm::FunctionType* t = llvm::FunctionType::get(llvm::Type::VoidTy, 
+                                                  arg_types, 
+                                                  false);
+  f = new llvm::Function(t, 
+                         llvm::GlobalValue::ExternalLinkage,
+                         "ncc_value_profile",
+                         module);
+  f->setDoesNotThrow();
+  return f;
+}
+
+/* sites are never removed, the result stays valid */
+Specializer::Site* Specializer::find_site(llvm::Function* f){
+  Site* site = NULL;
+  pthread_mutex_lock(&mutex);
+  for (std::deque<Site>::iterator i = sites.begin(); i != sites.end(); i++){
+    if (i->function == f){
+      site = &*i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return site;
+}
+
+/* the function without argument n, which a clone has folded in */
+static llvm::FunctionType* clone_type(llvm::Function* f, int n){
+  std::vector<const llvm::Type*> arg_types;
+  int k = 0;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++, k++){
+    if (k != n){
+      arg_types.push_back(i->getType());
+    }
+  }
+  return llvm::FunctionType::get(f->getReturnType(), arg_types, false);
+}
+
+/*
+ * Emits the entry hook into f, returns false when f has no integer
+ * arguments worth watching.
+ */
+bool Specializer::instrument(llvm::LLVMBuilder& builder, llvm::Function* f,
+                             Function* entry){
+  llvm::Module* module = f->getParent();
+  Site site;
+  int n = 0;
+
+  site.function = f;
+  site.entry = entry;
+  site.calls = 0;
+  site.busy = false;
+  site.done = false;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++){
+    if (i->getType() == llvm::Type::Int32Ty){
+      n++;
+    }
+  }
+  if (n == 0 || f->getName() == "main"){
+    return false;
+  }
+
+  n = 0;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++, n++){
+    Argument a;
+    a.value = 0;
+    a.streak = 0;
+    a.used = 0;
+    for (unsigned int k = 0; 
+         i->getType() == llvm::Type::Int32Ty && k < max_versions; k++){
+      std::ostringstream name;
+      name << f->getName() << ".spec.slot." << n << "." << k;
+      const llvm::PointerType* t = 
+        llvm::PointerType::getUnqual(clone_type(f, n));
+      Slot slot;
+      slot.code = new llvm::GlobalVariable(t, false,
+                                           llvm::GlobalValue::InternalLinkage,
+                                           llvm::ConstantPointerNull::get(t),
+                                           name.str(), module);
+      slot.value = 
+        new llvm::GlobalVariable(llvm::Type::Int32Ty, false,
+                                 llvm::GlobalValue::InternalLinkage,
+                                 llvm::ConstantInt::get(llvm::Type::Int32Ty, 
+                                                        0),
+                                 name.str() + ".value", module);
+      a.slots.push_back(slot);
+    }
+    site.arguments.push_back(a);
+  }
+
+  /* an address the JIT resolves, so no pointer of ours is in the IR */
+  llvm::Value* self = module->getGlobalVariable("ncc.specializer");
+  if (!self){
+    self = new llvm::GlobalVariable(llvm::Type::Int8Ty, false,
+                                    llvm::GlobalValue::ExternalLinkage,
+                                    NULL, "ncc.specializer", module);
+  }
+  pthread_mutex_lock(&mutex);
+  llvm::Value* id = llvm::ConstantInt::get(llvm::APInt(32, sites.size(), true));
+  sites.push_back(site);
+  pthread_mutex_unlock(&mutex);
+  n = 0;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++, n++){
+    if (i->getType() != llvm::Type::Int32Ty){
+      continue;
+    }
+    std::vector<llvm::Value*> a;
+    a.push_back(self);
+    a.push_back(id);
+    a.push_back(llvm::ConstantInt::get(llvm::APInt(32, n, true)));
+    a.push_back(i);
+    builder.CreateCall(get_hook(module), a.begin(), a.end());
+  }
+  return true;
+}
+
+/*
+ * A new entry block checks the slots: an argument equal to the value
+ * of a filled slot calls the clone there. Slots are filled in order,
+ * so the first empty one ends the checks of an argument. The allocas
+ * move along, so that they stay in the entry block.
+ */
+void Specializer::add_dispatch(llvm::Function* f){
+  Site* site = find_site(f);
+  if (!site){
+    return;
+  }
+  llvm::BasicBlock* body = &f->getEntryBlock();
+  llvm::BasicBlock* dispatch = new llvm::BasicBlock("dispatch", f, body);
+  llvm::LLVMBuilder builder(dispatch);
+  std::vector<llvm::Instruction*> allocas;
+  for (llvm::BasicBlock::iterator i = body->begin(); i != body->end(); i++){
+    if (llvm::isa<llvm::AllocaInst>(&*i)){
+      allocas.push_back(&*i);
+    }
+  }
+
+  int n = 0;
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++, n++){
+    Argument& a = site->arguments[n];
+    if (a.slots.empty()){
+      continue;
+    }
+    std::vector<llvm::Value*> args;
+    int k = 0;
+    for (llvm::Function::arg_iterator j = f->arg_begin(); 
+         j != f->arg_end(); j++, k++){
+      if (k != n){
+        args.push_back(j);
+      }
+    }
+    llvm::BasicBlock* next = new llvm::BasicBlock("next", f, body);
+    for (unsigned int s = 0; s < a.slots.size(); s++){
+      llvm::BasicBlock* check = new llvm::BasicBlock("check", f, body);
+      llvm::BasicBlock* call = new llvm::BasicBlock("specialized", f, body);
+      llvm::BasicBlock* more = (s + 1 < a.slots.size())
+        ? new llvm::BasicBlock("slot", f, body) : next;
+      llvm::Value* code = builder.CreateLoad(a.slots[s].code, "code");
+      llvm::Value* filled = 
+        builder.CreateICmpNE(code, 
+                             llvm::Constant::getNullValue(code->getType()),
+                             "filled");
+      builder.CreateCondBr(filled, check, next);
+
+      builder.SetInsertPoint(check);
+      llvm::Value* value = builder.CreateLoad(a.slots[s].value, "value");
+      builder.CreateCondBr(builder.CreateICmpEQ(i, value, "guard"), 
+                           call, more);
+
+      builder.SetInsertPoint(call);
+      llvm::CallInst* rv = builder.CreateCall(code, args.begin(), args.end());
+      rv->setCallingConv(f->getCallingConv());
+      if (f->getReturnType() == llvm::Type::VoidTy){
+        builder.CreateRetVoid();
+      } else {
+        builder.CreateRet(rv);
+      }
+      builder.SetInsertPoint(more);
+    }
+  }
+  builder.CreateBr(body);
+
+  llvm::Instruction* first = &*dispatch->begin();
+  for (std::vector<llvm::Instruction*>::iterator i = allocas.begin();
+       i != allocas.end(); i++){
+    (*i)->moveBefore(first);
+  }
+}
+
+/*
+ * Values that already have a clone go to it and are not reported, so
+ * a streak is always of a value without one.
+ */
+void Specializer::record(int id, int argument, int value){
+  pthread_mutex_lock(&mutex);
+  Site& site = sites[id];
+  Argument& a = site.arguments[argument];
+  unsigned int slot;
+
+  if (site.done || site.busy){
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  if (a.streak > 0 && a.value == value){
+    a.streak++;
+  } else {
+    a.value = value;
+    a.streak = 1;
+  }
+  site.calls++;
+
+  if (a.streak < threshold || a.used == a.slots.size()){
+    if (site.calls >= 100 * (unsigned long)threshold){
+      /* nothing stable about this one */
+      site.done = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  slot = a.used++;
+  site.busy = true;
+  pthread_mutex_unlock(&mutex);
+
+  /* other threads calling the function meanwhile are not counted */
+  specialize(site, argument, slot, value);
+
+  pthread_mutex_lock(&mutex);
+  unsigned int versions = 0;
+  bool open = false;
+  for (std::vector<Argument>::iterator i = site.arguments.begin();
+       i != site.arguments.end(); i++){
+    i->streak = 0;
+    versions += i->used;
+    open = open || i->used < i->slots.size();
+  }
+  site.calls = 0;
+  site.done = !open || versions >= max_versions;
+  site.busy = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+/* 
+ * The clone neither reports its arguments nor dispatches: its slots
+ * read as empty and the branches on them fold away.
+ */
+static void remove_hooks(llvm::Function* f, llvm::Function* hook,
+                         const std::set<llvm::Value*>& slots){
+  std::vector<llvm::Instruction*> dead;
+  for (llvm::Function::iterator b = f->begin(); b != f->end(); b++){
+    for (llvm::BasicBlock::iterator i = b->begin(); i != b->end(); i++){
+      llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&*i);
+      llvm::LoadInst* load = llvm::dyn_cast<llvm::LoadInst>(&*i);
+      if (call && call->getCalledFunction() == hook){
+        dead.push_back(call);
+      } else if (load && slots.count(load->getOperand(0))){
+        load->replaceAllUsesWith(
+          llvm::Constant::getNullValue(load->getType()));
+        dead.push_back(load);
+      }
+    }
+  }
+  for (std::vector<llvm::Instruction*>::iterator i = dead.begin();
+       i != dead.end(); i++){
+    (*i)->eraseFromParent();
+  }
+}
+
+static void optimize_clone(llvm::Function* f){
+  llvm::ExistingModuleProvider mp(f->getParent());
+  {
+    llvm::FunctionPassManager fpm(&mp);
+    fpm.add(llvm::createPromoteMemoryToRegisterPass());
+    fpm.add(llvm::createSCCPPass());
+    fpm.add(llvm::createInstructionCombiningPass());
+    fpm.add(llvm::createCFGSimplificationPass());
+    fpm.run(*f);
+  }
+  /* the module belongs to the execution engine */
+  mp.releaseModule();
+}
+
+void Specializer::specialize(Site& site, int argument, unsigned int slot,
+                             int value){
+  LLVMLock lock;
+  llvm::Function* f = site.function;
+  llvm::DenseMap<const llvm::Value*, llvm::Value*> vmap;
+  llvm::Value* constant = llvm::ConstantInt::get(llvm::APInt(32, value, true));
+  llvm::Value* fixed = NULL;
+  std::set<llvm::Value*> slots;
+  std::ostringstream name;
+  int n = 0;
+
+  for (llvm::Function::arg_iterator i = f->arg_begin(); 
+       i != f->arg_end(); i++, n++){
+    if (n == argument){
+      fixed = i;
+    }
+    for (std::vector<Slot>::iterator j = site.arguments[n].slots.begin();
+         j != site.arguments[n].slots.end(); j++){
+      slots.insert(j->code);
+    }
+  }
+  vmap[fixed] = constant;
+
+  name << f->getName() << ".spec." << site.entry->get_versions().size();
+  llvm::Function* clone = llvm::CloneFunction(f, vmap);
+  clone->setName(name.str());
+  clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+  f->getParent()->getFunctionList().push_back(clone);
+  remove_hooks(clone, get_hook(f->getParent()), slots);
+  optimize_clone(clone);
+
+  /* the value is in place before any thread can see the clone */
+  Slot& s = site.arguments[argument].slots[slot];
+  void* code = ee->getPointerToFunction(clone);
+  *(int volatile*)ee->getPointerToGlobal(s.value) = value;
+  __sync_synchronize();
+  *(void* volatile*)ee->getPointerToGlobal(s.code) = code;
+  site.entry->add_version(FunctionVersion(argument, value, clone));
+
+  if (log){
+    *log << "Specialized " << f->getName() << " for argument " 
+         << argument << " == " << value << std::endl;
+  }
+}
+
+extern "C" void ncc_value_profile(void* specializer, int site, 
+                                  int argument, int value){
+  ((Specializer*)specializer)->record(site, argument, value);
+}
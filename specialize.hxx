@@ -0,0 +1,93 @@
+#ifndef HXX__ncc__specialize__
+#define HXX__ncc__specialize__
+
+#include "symbol.hxx"
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <ostream>
+#include <pthread.h>
+
+namespace ncc {
+  /*
+   * Runtime value specialization for the JIT. Instrumented functions
+   * report their integer arguments on entry; once one argument has had
+   * the same value for `threshold' consecutive calls, a clone with that
+   * value folded in is compiled. Instrumented functions begin with a
+   * dispatch on slots per integer argument, so the clone is put in
+   * place by storing its address and value there: code that may be on
+   * the stack is never changed. A function gets up to max_versions
+   * clones, for one or several values of any of its arguments.
+   *
+   * Instrumented code runs on any thread. The mutex guards the sites,
+   * one thread at a time compiles a clone of a site, without it.
+   */
+  class Specializer {
+  protected:
+    /* where the dispatch finds a clone and its value, empty if NULL */
+    struct Slot {
+      llvm::GlobalVariable* code;
+      llvm::GlobalVariable* value;
+    };
+    struct Argument {
+      int value;
+      unsigned int streak;
+      /* none for arguments that are not integers */
+      std::vector<Slot> slots;
+      /* slots filled or being filled, in order */
+      unsigned int used;
+    };
+    struct Site {
+      llvm::Function* function;
+      Function* entry;
+      std::vector<Argument> arguments;
+      unsigned long calls;
+      bool busy;
+      bool done;
+    };
+    /* instrumented code refers to a site by its index */
+    std::deque<Site> sites;
+    pthread_mutex_t mutex;
+    llvm::ExecutionEngine* ee;
+    unsigned int threshold;
+    unsigned int max_versions;
+    std::ostream* log;
+
+    llvm::Function* get_hook(llvm::Module* module);
+    Site* find_site(llvm::Function* f);
+    void specialize(Site& site, int argument, unsigned int slot, int value);
+  public:
+    Specializer() : ee(NULL), threshold(1000), max_versions(4), log(NULL) {
+      pthread_mutex_init(&mutex, NULL);
+    }
+    ~Specializer(){
+      pthread_mutex_destroy(&mutex);
+    }
+    void set_engine(llvm::ExecutionEngine* engine){
+      ee = engine;
+    }
+    void set_threshold(unsigned int calls){
+      threshold = calls;
+    }
+    void set_log(std::ostream* stream){
+      log = stream;
+    }
+    bool instrument(llvm::LLVMBuilder& builder, llvm::Function* f,
+                    Function* entry);
+    /* puts the dispatch in front of an instrumented body once complete */
+    void add_dispatch(llvm::Function* f);
+    void record(int site, int argument, int value);
+  };
+}
+
+/* 
+ * Instrumented code passes the address of the global ncc.specializer,
+ * which the session maps to its Specializer.
+ */
+extern "C" void ncc_value_profile(void* specializer, int site, 
+                                  int argument, int value);
+
+#endif
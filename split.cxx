@@ -0,0 +1,108 @@
+#include "split.hxx"
+
+using namespace ncc;
+
+/*
+ * Splits the source into at most `chunks' pieces of similar size that
+ * each hold complete top-level forms. A form ends with a ';' or '}' at
+ * brace depth zero; comments, strings and character literals are
+ * skipped. Sources the scan cannot make sense of stay in one piece, so
+ * the parser reports their errors as usual.
+ */
+std::vector<SourceChunk> ncc::split_toplevel(const char* source, 
+                                             size_t length,
+                                             unsigned int chunks){
+  std::vector<SourceChunk> result;
+  SourceChunk current;
+  size_t target = length / (chunks ? chunks : 1);
+  size_t line_start = 0;
+  int line = 1;
+  int depth = 0;
+  size_t i = 0;
+
+  current.begin = 0;
+  current.line = 1;
+  current.column = 0;
+
+  while (i < length){
+    char ch = source[i];
+
+    if (ch == '\n'){
+      line++;
+      line_start = i + 1;
+      i++;
+      continue;
+    }
+
+    if (ch == '/' && i + 1 < length && source[i + 1] == '/'){
+      while (i < length && source[i] != '\n'){
+        i++;
+      }
+      continue;
+    }
+    if (ch == '/' && i + 1 < length && source[i + 1] == '*'){
+      i += 2;
+      while (i + 1 < length && !(source[i] == '*' && source[i + 1] == '/')){
+        if (source[i] == '\n'){
+          line++;
+          line_start = i + 1;
+        }
+        i++;
+      }
+      if (i + 1 >= length){
+        break;
+      }
+      i += 2;
+      continue;
+    }
+    if (ch == '"' || ch == '\''){
+      i++;
+      while (i < length && source[i] != ch){
+        if (source[i] == '\\'){
+          i++;
+        }
+        if (i < length && source[i] == '\n'){
+          line++;
+          line_start = i + 1;
+        }
+        i++;
+      }
+      if (i >= length){
+        break;
+      }
+      i++;
+      continue;
+    }
+
+    i++;
+    if (ch == '{'){
+      depth++;
+    } else if (ch == '}'){
+      depth--;
+      if (depth < 0){
+        break;
+      }
+    } else if (ch != ';'){
+      continue;
+    }
+    if (depth == 0 && i - current.begin >= target 
+        && result.size() + 1 < chunks){
+      current.end = i;
+      result.push_back(current);
+      current.begin = i;
+      current.line = line;
+      current.column = i - line_start;
+    }
+  }
+
+  if (i < length || depth != 0){
+    /* unterminated comment or string, or unbalanced braces */
+    result.clear();
+    current.begin = 0;
+    current.line = 1;
+    current.column = 0;
+  }
+  current.end = length;
+  result.push_back(current);
+  return result;
+}
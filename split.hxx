@@ -0,0 +1,20 @@
+#ifndef HXX__ncc__split__
+#define HXX__ncc__split__
+
+#include <vector>
+#include <cstddef>
+
+namespace ncc {
+  /* a run of whole top-level forms and where it starts in the source */
+  struct SourceChunk {
+    size_t begin;
+    size_t end;
+    int line;
+    int column;
+  };
+
+  std::vector<SourceChunk> split_toplevel(const char* source, size_t length,
+                                          unsigned int chunks);
+}
+
+#endif
@@ -11,21 +11,58 @@
 
 #include <string>
 #include <map>
+#include <set>
 
 namespace ncc {
 
+  class FunctionVersion {
+  protected:
+    int argument;
+    int value;
+    llvm::Function* address;
+  public:
+    FunctionVersion(int argument, int value, llvm::Function* address) :
+      argument(argument), value(value), address(address) {}
+    int get_argument(){
+      return argument;
+    }
+    int get_value(){
+      return value;
+    }
+    llvm::Function* get_address(){
+      return address;
+    }
+  };
+
   class Function {
   protected:
     ValueType ret_type;
     std::vector<ValueType> arg_types;
     llvm::Function* address;
+    /* what the body does, recorded during code generation */
+    bool defined;
+    bool exported;
+    bool reads_globals;
+    bool writes_globals;
+    std::set<std::string> callees;
+    /* specialized copies, tried in order before the generic code */
+    std::vector<FunctionVersion> versions;
+    /* holds the code calls go to when functions can be replaced */
+    llvm::GlobalVariable* cell;
   public:
-    Function(){}
+    Function() : address(NULL), defined(false), exported(false),
+                 reads_globals(false), writes_globals(false), 
+                 cell(NULL) {}
     Function(ValueType ret_type,
              const std::vector<ValueType>& arg_types,
              llvm::Function* address) : ret_type(ret_type),
                                         arg_types(arg_types),
-                                        address(address) {}
+                                        address(address),
+                                        defined(false),
+                                        exported(false),
+                                        reads_globals(false),
+                                        writes_globals(false),
+                                        cell(NULL) {}
     ValueType get_ret_type(){
       return ret_type;
     }
@@ -35,15 +72,107 @@ namespace ncc {
     int get_arg_count(){
       return arg_types.size();
     }
+    const std::vector<ValueType>& get_arg_types(){
+      return arg_types;
+    }
     llvm::Function* get_address(){
       return address;
     }
+    void set_address(llvm::Function* f){
+      address = f;
+    }
+    bool is_defined(){
+      return defined;
+    }
+    void set_defined(){
+      defined = true;
+    }
+    /* stays visible to the host after whole program optimization */
+    bool is_exported(){
+      return exported;
+    }
+    void set_exported(){
+      exported = true;
+    }
+    bool get_reads_globals(){
+      return reads_globals;
+    }
+    void note_global_read(){
+      reads_globals = true;
+    }
+    bool get_writes_globals(){
+      return writes_globals;
+    }
+    void note_global_write(){
+      writes_globals = true;
+    }
+    const std::set<std::string>& get_callees(){
+      return callees;
+    }
+    void note_call(const std::string& callee){
+      callees.insert(callee);
+    }
+    const std::vector<FunctionVersion>& get_versions(){
+      return versions;
+    }
+    void add_version(const FunctionVersion& version){
+      versions.push_back(version);
+    }
+    llvm::GlobalVariable* get_cell(){
+      return cell;
+    }
+    void set_cell(llvm::GlobalVariable* cell){
+      this->cell = cell;
+    }
+  };
+
+  class Profile;
+  class Specializer;
+
+  struct CodegenOptions {
+    FPModel fp_model;
+    bool whole_program;
+    Profile* profile;
+    Specializer* specializer;
+    /* calls go through cells, see Compiler::replace() */
+    bool hot_swap;
+    /* equal bodies share code, see FunctionDefinition::generate() */
+    bool dedup;
+    /* bytes of code to keep compiled, see Compiler::trim_code() */
+    size_t code_budget;
+
+    CodegenOptions() : fp_model(FP_STRICT), whole_program(false),
+                       profile(NULL), specializer(NULL), 
+                       hot_swap(false), dedup(false), code_budget(0) {}
+    /* functions whose code can change while other code runs */
+    bool uses_cells() const {
+      return hot_swap || code_budget;
+    }
   };
 
   class FunctionTable {
   protected:
     std::map<std::string, Function> table;
+    CodegenOptions options;
+    /* canonical forms of the bodies generated so far and their owners */
+    std::map<std::string, std::string> bodies;
+    unsigned int shared;
+    /* builtins that calls were generated for */
+    std::set<std::string> builtins;
   public:
+    typedef std::map<std::string, Function>::iterator iterator;
+    iterator begin(){
+      return table.begin();
+    }
+    iterator end(){
+      return table.end();
+    }
+    FunctionTable() : shared(0) {}
+    FunctionTable(const CodegenOptions& options) : options(options), 
+                                                   shared(0) {}
+    const CodegenOptions& get_options(){
+      return options;
+    }
     void put_function(const std::string& name,
                       const Function& func){
       table[name] = func;
@@ -55,6 +184,43 @@ namespace ncc {
       }
       return f->second;
     }
+    Function* find_function(const std::string& name){
+      std::map<std::string, Function>::iterator f = table.find(name);
+      if (f == table.end()){
+        return NULL;
+      }
+      return &f->second;
+    }
+    void remove_function(const std::string& name){
+      table.erase(name);
+    }
+    /* the function already having a body of that form, if any */
+    const std::string* find_body(const std::string& form){
+      std::map<std::string, std::string>::iterator b = bodies.find(form);
+      if (b == bodies.end()){
+        return NULL;
+      }
+      return &b->second;
+    }
+    void put_body(const std::string& form, const std::string& name){
+      bodies[form] = name;
+    }
+    /* functions using the code of another one */
+    unsigned int get_shared_count(){
+      return shared;
+    }
+    void note_shared(){
+      shared++;
+    }
+    void note_builtin(const std::string& name){
+      builtins.insert(name);
+    }
+    bool uses_builtin(const std::string& name){
+      return builtins.count(name) != 0;
+    }
+    const std::set<std::string>& get_builtins(){
+      return builtins;
+    }
   };
 
   class Variable {
@@ -80,17 +246,24 @@ namespace ncc {
     ValueType lex_rtype;
     llvm::Value* lex_retval;
     llvm::BasicBlock* lex_epilog;
+    FPModel lex_fp_model;
+    Function* lex_function;
     FunctionTable* ft;
   public:
     SymbolTable(FunctionTable* ft): parent(NULL), 
                                     lex_rtype(TYPE_VOID),
                                     lex_retval(NULL),
                                     lex_epilog(NULL),
-                                    ft(ft){}
+                                    lex_function(NULL),
+                                    ft(ft){
+      lex_fp_model = ft->get_options().fp_model;
+    }
     SymbolTable(SymbolTable* parent): parent(parent){
       lex_rtype = parent->get_lex_rtype();
       lex_retval = parent->get_lex_retval();
       lex_epilog = parent->get_lex_epilog();
+      lex_fp_model = parent->get_lex_fp_model();
+      lex_function = parent->get_lex_function();
       ft = parent->ft;
     }
     SymbolTable(SymbolTable* parent,
@@ -100,6 +273,8 @@ namespace ncc {
                                                lex_rtype(lex_rtype),
                                                lex_retval(lex_retval),
                                                lex_epilog(lex_epilog){
+      lex_fp_model = parent->get_lex_fp_model();
+      lex_function = parent->get_lex_function();
       ft = parent->ft;
     }
     Variable& get_symbol(const std::string name){
@@ -112,17 +287,23 @@ namespace ncc {
         }
         i = i->parent;
       }
-      throw UnknownSymbol(name);
+      throw new UnknownSymbol(name);
     }
     Function& get_function(const std::string name){
       return ft->get_function(name);
     }
+    Function* find_function(const std::string name){
+      return ft->find_function(name);
+    }
     void put_symbol(const std::string name, const Variable& var){
       symbols[name] = var;
     }
     void put_function(const std::string name, const Function& func){
       ft->put_function(name, func);
     }
+    FunctionTable* get_function_table(){
+      return ft;
+    }
     ValueType get_lex_rtype(){
       return lex_rtype;
     }
@@ -132,6 +313,21 @@ namespace ncc {
     llvm::BasicBlock* get_lex_epilog(){
       return lex_epilog;
     }
+    FPModel get_lex_fp_model(){
+      return lex_fp_model;
+    }
+    void set_lex_fp_model(FPModel model){
+      lex_fp_model = model;
+    }
+    Function* get_lex_function(){
+      return lex_function;
+    }
+    void set_lex_function(Function* function){
+      lex_function = function;
+    }
+    const CodegenOptions& get_options(){
+      return ft->get_options();
+    }
   };
 }
 
@@ -0,0 +1,232 @@
+#include "target.hxx"
+#include "lock.hxx"
+#include "exceptions.hxx"
+
+#include "llvm/Support/CommandLine.h"
+
+using namespace ncc;
+
+/*
+ * Host CPU features as reported by CPUID. Only features with an LLVM
+ * name are known to our code generator and get passed to the JIT, the
+ * rest is only detected for verbose output. Compiled code asks libgcc,
+ * which runs CPUID at startup and keeps the answer in __cpu_model.
+ */
+enum CPUIDRegister {
+  REG_EAX,
+  REG_EBX,
+  REG_ECX,
+  REG_EDX
+};
+
+struct CPUFeature {
+  const char* name;
+  const char* llvm_name;
+  unsigned int leaf;
+  CPUIDRegister reg;
+  int bit;
+  /* XCR0 bits of register state the OS has to save for the feature */
+  unsigned int os_state;
+  /* bit in __cpu_model.__cpu_features of libgcc, -1 if it has none */
+  int model_bit;
+};
+
+/* SSE and AVX halves of the vector registers */
+static const unsigned int AVX_STATE = 0x6;
+/* and the opmask registers and upper ZMM registers */
+static const unsigned int AVX512_STATE = 0xE6;
+
+static CPUFeature cpu_features[] = {
+  {"mmx", "mmx", 1, REG_EDX, 23, 0, 1},
+  {"sse", "sse", 1, REG_EDX, 25, 0, 3},
+  {"sse2", "sse2", 1, REG_EDX, 26, 0, 4},
+  {"sse3", "sse3", 1, REG_ECX, 0, 0, 5},
+  {"ssse3", "ssse3", 1, REG_ECX, 9, 0, 6},
+  {"sse4.1", NULL, 1, REG_ECX, 19, 0, 7},
+  {"sse4.2", NULL, 1, REG_ECX, 20, 0, 8},
+  {"popcnt", NULL, 1, REG_ECX, 23, 0, 2},
+  {"avx", NULL, 1, REG_ECX, 28, AVX_STATE, 9},
+  {"fma", NULL, 1, REG_ECX, 12, AVX_STATE, 14},
+  {"avx2", NULL, 7, REG_EBX, 5, AVX_STATE, 10},
+  {"bmi2", NULL, 7, REG_EBX, 8, 0, 17},
+  {"avx512f", NULL, 7, REG_EBX, 16, AVX512_STATE, 15},
+  {"64bit", "64bit", 0x80000001, REG_EDX, 29, 0, -1},
+};
+
+#if defined(__i386__) || defined(__x86_64__)
+static void cpuid(unsigned int leaf, unsigned int regs[4]){
+#if defined(__i386__) && defined(__PIC__)
+  /* %ebx holds the GOT pointer and must survive */
+  asm volatile("xchgl %%ebx, %1\n\t"
+               "cpuid\n\t"
+               "xchgl %%ebx, %1"
+               : "=a"(regs[REG_EAX]), "=&r"(regs[REG_EBX]),
+                 "=c"(regs[REG_ECX]), "=d"(regs[REG_EDX])
+               : "0"(leaf), "2"(0));
+#else
+  asm volatile("cpuid"
+               : "=a"(regs[REG_EAX]), "=b"(regs[REG_EBX]),
+                 "=c"(regs[REG_ECX]), "=d"(regs[REG_EDX])
+               : "0"(leaf), "2"(0));
+#endif
+}
+
+/* 
+ * Register state has to be enabled by the OS, not only present in the
+ * CPU. Returns the state components the OS saves, none without XSAVE.
+ */
+static unsigned int enabled_os_state(){
+  unsigned int regs[4];
+  unsigned int xcr0_lo;
+  unsigned int xcr0_hi;
+
+  cpuid(1, regs);
+  if (!(regs[REG_ECX] & (1 << 27))){
+    return 0;
+  }
+  /* xgetbv, spelled out for assemblers that do not know it */
+  asm volatile(".byte 0x0f, 0x01, 0xd0"
+               : "=a"(xcr0_lo), "=d"(xcr0_hi)
+               : "c"(0));
+  return xcr0_lo;
+}
+
+std::vector<std::string> ncc::detect_host_features(){
+  std::vector<std::string> features;
+  unsigned int regs[4];
+  unsigned int max_leaf;
+  unsigned int max_ext_leaf;
+  unsigned int os_state = enabled_os_state();
+
+  cpuid(0, regs);
+  max_leaf = regs[REG_EAX];
+  cpuid(0x80000000, regs);
+  max_ext_leaf = regs[REG_EAX];
+
+  for (unsigned int i = 0; i < sizeof(cpu_features) / sizeof(CPUFeature); i++){
+    CPUFeature& f = cpu_features[i];
+    if (f.leaf >= 0x80000000 ? f.leaf > max_ext_leaf : f.leaf > max_leaf){
+      continue;
+    }
+    if ((os_state & f.os_state) != f.os_state){
+      continue;
+    }
+    cpuid(f.leaf, regs);
+    if (regs[f.reg] & (1U << f.bit)){
+      features.push_back(f.name);
+    }
+  }
+  return features;
+}
+#else
+std::vector<std::string> ncc::detect_host_features(){
+  return std::vector<std::string>();
+}
+#endif
+
+static const char* llvm_feature_name(const std::string& feature){
+  for (unsigned int i = 0; i < sizeof(cpu_features) / sizeof(CPUFeature); i++){
+    if (feature == cpu_features[i].name){
+      return cpu_features[i].llvm_name;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Clones can be compiled for features our code generator knows and
+ * checked at run time for those libgcc reports. Returns the bit of the
+ * feature in __cpu_model, -1 if it cannot have a clone.
+ */
+int ncc::get_clone_feature_bit(const std::string& feature){
+  for (unsigned int i = 0; i < sizeof(cpu_features) / sizeof(CPUFeature); i++){
+    if (feature == cpu_features[i].name){
+      return cpu_features[i].llvm_name ? cpu_features[i].model_bit : -1;
+    }
+  }
+  return -1;
+}
+
+/* the -mattr string of a clone, attrs with its feature turned on */
+std::string ncc::get_clone_attrs(const std::string& attrs,
+                                 const std::string& feature){
+  std::string enable = std::string("+") + llvm_feature_name(feature);
+  return attrs.empty() ? enable : attrs + "," + enable;
+}
+
+/* the -mattr string for cpu, "native" expands to the detected features */
+std::string ncc::get_target_features(const std::string& cpu,
+                                     const std::string& attrs){
+  std::string features;
+
+  if (cpu == "native"){
+    std::vector<std::string> host = detect_host_features();
+    for (std::vector<std::string>::iterator i = host.begin();
+         i != host.end(); i++){
+      const char* name = llvm_feature_name(*i);
+      if (name){
+        if (!features.empty()){
+          features += ",";
+        }
+        features += std::string("+") + name;
+      }
+    }
+  }
+  if (!attrs.empty()){
+    if (!features.empty()){
+      features += ",";
+    }
+    features += attrs;
+  }
+  return features;
+}
+
+/*
+ * The JIT picks its subtarget from the -mcpu and -mattr options of the
+ * LLVM command line, so we hand our choice over through it. Returns the
+ * feature string that was selected. That command line can only be
+ * parsed once, so the first session of a process decides for all and
+ * later ones must ask for the same target.
+ */
+std::string ncc::select_jit_target(const std::string& cpu, 
+                                   const std::string& attrs){
+  static std::string selected;
+  static std::string selected_cpu;
+  static std::string selected_attrs;
+  static bool done = false;
+  LLVMLock lock;
+  if (done){
+    if (cpu != selected_cpu || attrs != selected_attrs){
+      throw new InvalidArgument("the JIT of this process already targets "
+                                "cpu " + selected_cpu + " with features '"
+                                + selected + "'");
+    }
+    return selected;
+  }
+
+  std::string features = get_target_features(cpu, attrs);
+  std::vector<std::string> llvm_args;
+
+  if (cpu != "native" && !cpu.empty()){
+    llvm_args.push_back("-mcpu=" + cpu);
+  }
+  if (!features.empty()){
+    llvm_args.push_back("-mattr=" + features);
+  }
+
+  std::vector<char*> argv;
+  argv.push_back((char*)"ncc");
+  for (std::vector<std::string>::iterator i = llvm_args.begin();
+       i != llvm_args.end(); i++){
+    argv.push_back((char*)i->c_str());
+  }
+  argv.push_back(NULL);
+  int argc = argv.size() - 1;
+  llvm::cl::ParseCommandLineOptions(argc, &argv[0]);
+
+  selected = features;
+  selected_cpu = cpu;
+  selected_attrs = attrs;
+  done = true;
+  return features;
+}
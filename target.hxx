@@ -0,0 +1,18 @@
+#ifndef HXX__ncc__target__
+#define HXX__ncc__target__
+
+#include <string>
+#include <vector>
+
+namespace ncc {
+  std::vector<std::string> detect_host_features();
+  int get_clone_feature_bit(const std::string& feature);
+  std::string get_clone_attrs(const std::string& attrs,
+                              const std::string& feature);
+  std::string get_target_features(const std::string& cpu,
+                                  const std::string& attrs);
+  std::string select_jit_target(const std::string& cpu, 
+                                const std::string& attrs);
+}
+
+#endif
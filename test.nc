@@ -40,6 +40,101 @@ int test_short_circuit(){
   int b = 2;
   return (1 && (b || 0)) == 2;
 }
+/* builtins, a definition of the same name hides one */
+int ctlz(int x){
+  return 42;
+}
+int test_builtins(){
+  return sqrt(16.0) == 4.0 && fabs(-2.5) == 2.5 && floor(2.5) == 2.0
+    && pow(2.0, 10.0) == 1024.0 && popcount(7) == 3 && abs(-3) == 3
+    && ctlz(1) == 42;
+}
+/* the fp_model of a function wins over --fp-model */
+[[fp_model(strict)]] float strict_third(float x){
+  return x / 3.0;
+}
+[[fp_model(fast)]] float fast_third(float x){
+  return x / 3.0;
+}
+int test_fp_model(){
+  float three = 3.0;
+  float third = 1.0 / three;
+  return strict_third(5.0) == 5.0 / three
+    && fast_third(5.0) == 5.0 * third;
+}
+/* calls before the definition go through the prototype it completes */
+int is_odd(int n);
+int is_even(int n){
+  if (n == 0){
+    return 1;
+  }
+  return is_odd(n - 1);
+}
+int is_odd(int n){
+  if (n == 0){
+    return 0;
+  }
+  return is_even(n - 1);
+}
+/* the only function besides main() that --whole-program lets be called */
+[[export]] int twice(int x){
+  return 2 * x;
+}
+int test_prototypes(){
+  return is_even(10) && is_odd(7) && !is_odd(4) && twice(21) == 42;
+}
+/* 
+ * Calls to functions inferred readnone or readonly may be merged or
+ * dropped, calls writing globals must stay where they are.
+ */
+int counter;
+int bump(){
+  counter = counter + 1;
+  return 1;
+}
+int get_counter(){
+  return counter;
+}
+int square(int x){
+  return x * x;
+}
+int counter_odd(int n);
+int counter_even(int n){
+  if (n == 0){
+    return get_counter();
+  }
+  return counter_odd(n - 1);
+}
+int counter_odd(int n){
+  return counter_even(n - 1);
+}
+int test_inference(){
+  int before = get_counter();
+  bump();
+  bump();
+  return square(3) + square(3) == 18 && get_counter() == before + 2
+    && counter_even(4) == before + 2;
+}
+/* the JIT runs the default, emitted assembly has a clone per ISA */
+[[target_clones("ssse3", "sse3", "default")]] float dot(float a, float b){
+  return a * a + b * b;
+}
+int test_target_clones(){
+  return dot(3.0, 4.0) == 25.0;
+}
+/* with --specialize, factor gets a version for each of its values */
+int scaled(int x, int factor){
+  return x * factor;
+}
+int test_specialize(){
+  int i = 0;
+  int sum = 0;
+  while (i < 300){
+    sum = sum + scaled(i, 1 + i / 100);
+    i = i + 1;
+  }
+  return sum == 109700;
+}
 
 int main(){
   init_gvar_test();
@@ -61,5 +156,23 @@ int main(){
   if (!test_short_circuit()){
     return 6;
   }
+  if (!test_builtins()){
+    return 7;
+  }
+  if (!test_fp_model()){
+    return 8;
+  }
+  if (!test_prototypes()){
+    return 9;
+  }
+  if (!test_inference()){
+    return 10;
+  }
+  if (!test_specialize()){
+    return 11;
+  }
+  if (!test_target_clones()){
+    return 12;
+  }
   return 0; /* success */
 }
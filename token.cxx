@@ -1,7 +1,10 @@
 #include "token.hxx"
 #include "exceptions.hxx"
+#include "scan.hxx"
 #include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 
 using namespace ncc;
 
@@ -84,7 +87,7 @@ void Tokenizer::parse_number(){
 }
 
 int Tokenizer::read_char(bool eof_ok) {
-  int ch = stream.get();
+  int ch = stream->get();
 
   if (ch == '\n') {
     line++;
@@ -93,8 +96,8 @@ int Tokenizer::read_char(bool eof_ok) {
     column++;
   }
 
-  if (!stream.good()){
-    if (eof_ok && stream.eof()){
+  if (!stream->good()){
+    if (eof_ok && stream->eof()){
       return EOF;
     }
     throw new InvalidToken();
@@ -109,7 +112,7 @@ void Tokenizer::unread_char(){
   } else {
     column--;
   }
-  stream.unget();
+  stream->unget();
 }
 
 void Tokenizer::skip_line_comment(){
@@ -131,8 +134,7 @@ void Tokenizer::skip_comment(){
   }
 }
 
-char Tokenizer::read_char_escape(){
-  int ch = read_char(false);
+static char escape_char(int ch){
   switch (ch){
   case 'n':
     return '\n';
@@ -154,6 +156,10 @@ char Tokenizer::read_char_escape(){
   }
 }
 
+char Tokenizer::read_char_escape(){
+  return escape_char(read_char(false));
+}
+
 void Tokenizer::parse_string(){
   int ch;
   text = "";
@@ -172,9 +178,53 @@ void Tokenizer::parse_string(){
   }
 }
 
+/* the token at index in the array, decoded like the stream would be */
+void Tokenizer::next_array_token(){
+  const char* p = tokens->get_text(index);
+  size_t n = tokens->get_length(index);
+
+  token = tokens->get_kind(index);
+  if (token != TOKEN_EOF){
+    index++;
+  }
+  switch (token){
+  case TOKEN_INVALID:
+    throw new InvalidToken();
+  case TOKEN_INT_VALUE:
+  case TOKEN_FLOAT_VALUE:
+    if (*p == '\''){
+      int_value = (p[1] == '\\') ? escape_char(p[2]) : p[1];
+      token = TOKEN_INT_VALUE;
+    } else {
+      text.assign(p, n);
+      parse_number();
+    }
+    break;
+  case TOKEN_STRING:
+    text = "";
+    for (size_t i = 1; i + 1 < n; i++){
+      if (p[i] == '\\'){
+        text += escape_char(p[++i]);
+      } else {
+        text += p[i];
+      }
+    }
+    break;
+  default:
+    if (token == TOKEN_IDENT || (token >= TOKEN_IF && token <= TOKEN_RETURN)){
+      text.assign(p, n);
+    }
+  }
+}
+
 void Tokenizer::next_token() {
   int ch;
 
+  if (tokens){
+    next_array_token();
+    return;
+  }
+
   do {
   next:
     ch = read_char(true);
@@ -249,6 +299,8 @@ void Tokenizer::next_token() {
   case ':':
   case '~':
   case '^':
+  case '[':
+  case ']':
     token = ch;
     return;
   case '=':
@@ -310,3 +362,114 @@ void Tokenizer::next_token() {
     throw new InvalidToken();
   }
 }
+
+/* characters that are tokens by themselves */
+static const char* single_tokens = "+-*/(){};,?:~^[]";
+
+/*
+ * Mirrors Tokenizer::next_token over the whole buffer. Where the stream
+ * tokenizer would throw, a TOKEN_INVALID ends the array.
+ */
+TokenArray::TokenArray(const char* source, size_t length, 
+                       int line, int column) : source(source),
+                                               base_line(line),
+                                               base_column(column){
+  size_t i = 0;
+
+  scan_lines(source, length, line_starts);
+  for (;;){
+    i = scan_whitespace(source, length, i);
+    if (i >= length){
+      add(TOKEN_EOF, length, 0);
+      return;
+    }
+
+    char ch = source[i];
+    size_t end;
+    if (ch == '/' && i + 1 < length && source[i + 1] == '/'){
+      end = scan_line_end(source, length, i + 2);
+      if (end >= length){
+        break;
+      }
+      i = end + 1;
+      continue;
+    }
+    if (ch == '/' && i + 1 < length && source[i + 1] == '*'){
+      end = scan_comment_end(source, length, i + 2);
+      if (end >= length){
+        break;
+      }
+      i = end + 2;
+      continue;
+    }
+
+    if (isdigit((unsigned char)ch)){
+      end = scan_number(source, length, i);
+      add(memchr(source + i, '.', end - i) ? 
+          TOKEN_FLOAT_VALUE : TOKEN_INT_VALUE, i, end - i);
+    } else if (isalpha((unsigned char)ch)){
+      end = scan_identifier(source, length, i);
+      add(keyword_token(std::string(source + i, end - i)), i, end - i);
+    } else if (ch == '"'){
+      for (end = i + 1; end < length && source[end] != '"'; end++){
+        if (source[end] == '\\'){
+          end++;
+        }
+      }
+      if (end >= length){
+        break;
+      }
+      end++;
+      add(TOKEN_STRING, i, end - i);
+    } else if (ch == '\''){
+      end = i + 1;
+      if (end < length && source[end] == '\\'){
+        end++;
+      }
+      end++;
+      if (end >= length || source[end] != '\''){
+        break;
+      }
+      end++;
+      add(TOKEN_INT_VALUE, i, end - i);
+    } else if (strchr(single_tokens, ch)){
+      end = i + 1;
+      add(ch, i, 1);
+    } else if (strchr("=!<>&|", ch)){
+      char second = (ch == '&' || ch == '|') ? ch : '=';
+      end = i + 1;
+      if (end < length && source[end] == second){
+        end++;
+        switch (ch){
+        case '=': ch = TOKEN_EQUAL; break;
+        case '!': ch = TOKEN_NOT_EQUAL; break;
+        case '<': ch = TOKEN_LT_EQUAL; break;
+        case '>': ch = TOKEN_GT_EQUAL; break;
+        case '&': ch = TOKEN_SC_AND; break;
+        case '|': ch = TOKEN_SC_OR; break;
+        }
+      }
+      add(ch, i, end - i);
+    } else {
+      break;
+    }
+    i = end;
+  }
+  add(TOKEN_INVALID, i, i < length ? 1 : 0);
+}
+
+/* line and column just after token i, as the stream tokenizer counts */
+void TokenArray::get_position(size_t i, int& line, int& column) const {
+  size_t end = offsets[i] + lengths[i];
+  std::vector<size_t>::const_iterator l = 
+    std::upper_bound(line_starts.begin(), line_starts.end(), 
+                     end > 0 ? end - 1 : 0);
+  size_t n = l - line_starts.begin();
+
+  line = base_line + n;
+  if (n == 0){
+    column = base_column + end;
+  } else {
+    column = end - line_starts[n - 1];
+  }
+}
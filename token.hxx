@@ -2,6 +2,7 @@
 #define HXX__ncc__token__
 
 #include <string>
+#include <vector>
 #include <iostream>
 
 #include "exceptions.hxx"
@@ -27,10 +28,52 @@ namespace ncc {
   static const char TOKEN_LT_EQUAL = 17;
   static const char TOKEN_SC_AND = 18;
   static const char TOKEN_SC_OR = 19;
+  /* only in token arrays, raises InvalidToken when reached */
+  static const char TOKEN_INVALID = 127;
+
+  /*
+   * A whole buffer split into tokens up front, stored as parallel arrays
+   * of kind, offset and length. Values are decoded when the tokenizer
+   * reaches a token. The buffer must outlive the array.
+   */
+  class TokenArray {
+  protected:
+    const char* source;
+    std::vector<char> kinds;
+    std::vector<unsigned int> offsets;
+    std::vector<unsigned int> lengths;
+    std::vector<size_t> line_starts;
+    int base_line;
+    int base_column;
+
+    void add(char kind, size_t offset, size_t length){
+      kinds.push_back(kind);
+      offsets.push_back(offset);
+      lengths.push_back(length);
+    }
+  public:
+    TokenArray(const char* source, size_t length, 
+               int line = 1, int column = 0);
+    size_t size() const {
+      return kinds.size();
+    }
+    char get_kind(size_t i) const {
+      return kinds[i];
+    }
+    const char* get_text(size_t i) const {
+      return source + offsets[i];
+    }
+    size_t get_length(size_t i) const {
+      return lengths[i];
+    }
+    void get_position(size_t i, int& line, int& column) const;
+  };
 
   class Tokenizer {
   protected:
-    std::istream& stream;
+    std::istream* stream;
+    const TokenArray* tokens;
+    size_t index;
     char token;
     std::string text;
     int int_value;
@@ -48,9 +91,15 @@ namespace ncc {
     void parse_string();
     int read_char(bool eof_ok);
     void unread_char();
+    void next_array_token();
   public:
     Tokenizer(std::istream& stream): 
-      stream(stream), line(1), column(0) {};
+      stream(&stream), tokens(NULL), line(1), column(0) {};
+    /* for a stream that starts in the middle of a file */
+    Tokenizer(std::istream& stream, int line, int column): 
+      stream(&stream), tokens(NULL), line(line), column(column) {};
+    Tokenizer(const TokenArray& tokens): 
+      stream(NULL), tokens(&tokens), index(0), line(1), column(0) {};
     char current_token(){
       return token;
     }
@@ -79,10 +128,20 @@ namespace ncc {
         throw new ExpectedToken(expected, current_token());
       }
     }
+    /* position of the current token in the token array */
+    size_t get_token_index(){
+      return token == TOKEN_EOF ? index : index - 1;
+    }
     int get_line(){
+      if (tokens && index > 0){
+        tokens->get_position(index - 1, line, column);
+      }
       return line;
     }
     int get_column(){
+      if (tokens && index > 0){
+        tokens->get_position(index - 1, line, column);
+      }
       return column;
     }
   };
@@ -43,7 +43,14 @@ namespace ncc {
     ASOP_ASSIGN
   };
 
+  enum FPModel {
+    FP_STRICT,
+    FP_CONTRACT,
+    FP_FAST
+  };
+
   std::string get_token_name(char token);
+  FPModel get_fp_model(const std::string& name);
 
 }
 